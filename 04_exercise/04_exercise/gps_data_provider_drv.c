@@ -6,10 +6,389 @@
 #include <linux/err.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/ioctl.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/time.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/fixp-arith.h>
 
 #define DEVICE_NAME             ("GPS_Device")
 #define DEVICE_CLASS            ("GPS_Class")
 
+#define GPS_SET_FORMAT          _IOW('g', 1, int)
+#define GPS_GET_FORMAT          _IOR('g', 2, int)
+#define GPS_TRACK_CLEAR         _IO('g', 3)
+#define GPS_TRACK_START         _IOW('g', 4, struct gps_replay_cfg)
+#define GPS_TRACK_STOP          _IO('g', 5)
+#define GPS_TRACK_STATUS        _IOR('g', 6, struct gps_replay_status)
+#define GPS_GET_LOST            _IOR('g', 7, __u64)
+#define GPS_HISTORY_QUERY       _IOWR('g', 8, struct gps_range_query)
+#define GPS_FENCE_ADD           _IOW('g', 9, struct gps_fence_def)
+#define GPS_FENCE_DEL           _IOW('g', 10, __u32)
+#define GPS_FENCE_CLEAR         _IO('g', 11)
+#define GPS_SET_WRITE_MODE      _IOW('g', 12, int)
+#define GPS_GET_INGEST_STATS    _IOR('g', 13, struct gps_ingest_stats)
+#define GPS_SET_FILTER          _IOW('g', 14, struct gps_filter_cfg)
+#define GPS_GET_FILTER          _IOR('g', 15, struct gps_filter_cfg)
+
+#define GPS_WRITE_TRACK         (0)
+#define GPS_WRITE_LIVE          (1)
+
+#define GPS_FORMAT_NMEA         (0)
+#define GPS_FORMAT_BINARY       (1)
+#define GPS_FORMAT_FENCE_EVENTS (2)
+
+#define GPS_FIX_INTERVAL_MS     (1000)
+#define GPS_FIX_RING_SIZE       (1024)
+#define GPS_FIX_RING_MASK       (GPS_FIX_RING_SIZE - 1)
+#define GPS_READ_BATCH          (8)
+#define GPS_NMEA_MAX_LEN        (96)
+#define GPS_NMEA_FIX_MAX        (2 * GPS_NMEA_MAX_LEN)
+#define GPS_NMEA_LINE_MAX       (GPS_NMEA_MAX_LEN)
+#define GPS_NMEA_MAX_FIELDS     (24)
+#define GPS_NMEA_WRITE_CHUNK    (256)
+#define GPS_NMEA_HAVE_GGA       (0x1)
+#define GPS_NMEA_HAVE_RMC       (0x2)
+#define GPS_NMEA_HAVE_VTG       (0x4)
+
+#define GPS_TRACK_MAX_FIXES     (65536)
+#define GPS_REPLAY_MAX_RATE     (1000)
+#define GPS_REPLAY_MIN_TICK_NS  (100 * NSEC_PER_USEC)
+#define GPS_REPLAY_LOOP         (0x1)
+
+#define GPS_HISTORY_LEN         (16384)
+#define GPS_HISTORY_MASK        (GPS_HISTORY_LEN - 1)
+#define GPS_HISTORY_RETRIES     (4)
+
+#define GPS_FENCE_CIRCLE        (0)
+#define GPS_FENCE_POLYGON       (1)
+#define GPS_FENCE_ENTER         (1)
+#define GPS_FENCE_EXIT          (2)
+#define GPS_FENCE_MAX           (8192)
+#define GPS_FENCE_MAX_VERTICES  (32)
+#define GPS_FENCE_MAX_CELLS     (1024)
+#define GPS_FENCE_MAX_LAT_E7    (850000000)
+#define GPS_GRID_CELL_E7        (100000)    /* 0.01 degree, ~1.1 km */
+#define GPS_GRID_HASH_BITS      (14)
+#define GPS_FENCE_ID_HASH_BITS  (10)
+#define GPS_EVENT_RING_SIZE     (1024)
+#define GPS_EVENT_RING_MASK     (GPS_EVENT_RING_SIZE - 1)
+
+/* Simulated receiver: a circle of ~110 m radius around a fixed point. */
+#define GPS_SIM_BASE_LAT_E7     (99312000)
+#define GPS_SIM_BASE_LON_E7     (762673000)
+#define GPS_SIM_RADIUS_E7       (10000)
+#define GPS_SIM_STEP_DEG        (6)
+#define GPS_SIM_ALT_MM          (12000)
+#define GPS_SIM_SATS            (9)
+#define GPS_SIM_HDOP_C          (90)
+#define GPS_MM_PER_E7_NUM       (11132)
+#define GPS_MM_PER_E7_DEN       (1000)
+
+#define GPS_QUALITY_NO_FIX      (0)
+#define GPS_QUALITY_GPS         (1)
+
+#define GPS_FIX_FLAG_OVERRUN    (0x0001)
+#define GPS_FIX_FLAG_FILTERED   (0x0002)
+
+/* Kalman smoothing stage, see gps_filter_apply(). */
+#define GPS_FILTER_ACCEL_MMPS2  (2000)
+#define GPS_FILTER_SIGMA_MM     (3000)
+#define GPS_FILTER_GAP_MS       (5000)
+#define GPS_FILTER_MAX_ACCEL    (20000)
+#define GPS_FILTER_MAX_SIGMA_MM (1000000)
+#define GPS_FILTER_MAX_GAP_MS   (60000)
+#define GPS_FILTER_INIT_VEL     (30000)     /* mm/s, initial velocity std dev */
+#define GPS_FILTER_MAX_VAR      (1LL << 40)    /* keeps the products below in s64 */
+#define GPS_FILTER_MAX_VEL      (1LL << 30)    /* mm/s, keeps the speed square in s64 */
+#define GPS_FILTER_MAX_SPAN_E7  (10000000)  /* re-centre after 1 degree */
+#define GPS_FILTER_MAX_LAT_E7   (850000000)
+#define GPS_Q16_ONE             (1 << 16)
+
+#define GPS_LAT_BUCKETS         (40)
+#define GPS_DEBUGFS_DIR         ("gps_device")
+
+/*****************************************
+*   Data Structures.
+*****************************************/
+/*
+* Binary fix record returned by gps_dev_read in GPS_FORMAT_BINARY mode.
+* Fixed size, so a read of N * sizeof(struct gps_fix_record) bytes
+* returns up to N whole records.
+*/
+struct gps_fix_record
+{
+    __u64 timestamp_ns;         /* UTC, ns since the epoch */
+    __s32 lat_e7;               /* degrees * 1e7, north positive */
+    __s32 lon_e7;               /* degrees * 1e7, east positive */
+    __s32 alt_mm;               /* altitude above MSL */
+    __u32 speed_mmps;           /* ground speed */
+    __u16 course_cdeg;          /* course over ground, degrees * 100 */
+    __u16 hdop_c;               /* HDOP * 100 */
+    __u8  quality;              /* GGA fix quality */
+    __u8  num_sats;
+    __u16 flags;                /* GPS_FIX_FLAG_* */
+    __u64 gen_ns;               /* ktime_get_ns() when the fix was published */
+    __u64 read_ns;              /* ktime_get_ns() when this reader received it */
+};
+
+/* Generation-to-read latency, bucket i counts latencies in [2^i, 2^(i+1)) ns. */
+struct gps_latency_hist
+{
+    u64 bucket[GPS_LAT_BUCKETS];
+};
+
+/*
+* GPS_SET_FILTER / GPS_GET_FILTER. Process noise is given as the standard
+* deviation of acceleration, measurement noise as the position error at
+* HDOP 1; each fix is weighted by its own HDOP.
+*/
+struct gps_filter_cfg
+{
+    __u32 enable;
+    __u32 accel_mmps2;
+    __u32 sigma_mm;
+    __u32 reset_gap_ms;         /* restart the filter after a longer gap */
+};
+
+struct gps_replay_cfg
+{
+    __u32 rate;                 /* playback speed multiplier, 1 = real time */
+    __u32 flags;                /* GPS_REPLAY_LOOP */
+};
+
+/*
+* GPS_HISTORY_QUERY: copy up to max_records history fixes with
+* t_start_ns <= timestamp_ns <= t_end_ns into records, oldest first.
+* total is the number of fixes in the range, which may exceed count.
+*/
+struct gps_range_query
+{
+    __u64 t_start_ns;
+    __u64 t_end_ns;
+    __u64 records;              /* user pointer to struct gps_fix_record[] */
+    __u32 max_records;
+    __u32 count;                /* out */
+    __u32 total;                /* out */
+    __u32 reserved;
+};
+
+struct gps_fence_point
+{
+    __s32 lat_e7;
+    __s32 lon_e7;
+};
+
+/* GPS_FENCE_ADD: a circle (center, radius_mm) or a simple polygon. */
+struct gps_fence_def
+{
+    __u32 id;
+    __u32 type;                 /* GPS_FENCE_CIRCLE or GPS_FENCE_POLYGON */
+    __u32 radius_mm;
+    __u32 num_vertices;
+    struct gps_fence_point center;
+    struct gps_fence_point vertices[GPS_FENCE_MAX_VERTICES];
+};
+
+/* Record returned by gps_dev_read in GPS_FORMAT_FENCE_EVENTS mode. */
+struct gps_fence_event
+{
+    __u64 timestamp_ns;         /* UTC time of the fix that crossed */
+    __u32 fence_id;
+    __u32 type;                 /* GPS_FENCE_ENTER or GPS_FENCE_EXIT */
+    __s32 lat_e7;
+    __s32 lon_e7;
+};
+
+struct gps_ingest_stats
+{
+    __u64 sentences;            /* sentences with a valid checksum */
+    __u64 bad_checksum;
+    __u64 malformed;            /* unknown, overlong or undecodable sentences */
+    __u64 fixes;                /* fixes produced from sentences */
+    __u64 dropped;              /* fixes lost by failed flushes, on any file */
+};
+
+struct gps_replay_status
+{
+    __u32 track_len;
+    __u32 position;
+    __u32 rate;
+    __u32 running;
+};
+
+/*
+* One ring entry. seq is the fix sequence number + 1 once the slot is
+* published and 0 while the producer is rewriting it, so a lock-free
+* reader can tell a stable slot from one overwritten under it.
+*/
+struct gps_ring_slot
+{
+    u64 seq;
+    struct gps_fix_record fix;
+};
+
+struct gps_event_slot
+{
+    u64 seq;
+    struct gps_fence_event event;
+};
+
+struct gps_fence;
+
+/* One grid cell a fence's bounding box overlaps, hashed by cell key. */
+struct gps_fence_ref
+{
+    struct hlist_node node;
+    u64 key;
+    struct gps_fence* fence;
+};
+
+struct gps_fence
+{
+    struct hlist_node id_node;
+    struct list_head inside_node;
+    struct gps_fence_ref* refs;
+    u32 nrefs;
+    u64 epoch;                  /* last fix this fence was evaluated for */
+    bool inside;
+    s32 min_lat, max_lat, min_lon, max_lon;
+    s32 cos_q15;                /* circle: cos(latitude of the center) */
+    struct gps_fence_def def;
+};
+
+/* Position and velocity along one axis with their 2x2 covariance. */
+struct gps_kalman_axis
+{
+    s64 pos;                    /* mm from the filter origin */
+    s64 vel;                    /* mm/s */
+    s64 p00;                    /* mm^2 */
+    s64 p01;                    /* mm^2/s */
+    s64 p11;                    /* mm^2/s^2 */
+};
+
+/*
+* Constant-velocity Kalman filter in a local east/north plane around
+* origin, in integer millimetres so it can run in the producer without
+* touching the FPU.
+*/
+struct gps_filter
+{
+    struct gps_filter_cfg cfg;
+    bool primed;
+    u64 last_ts;
+    s32 origin_lat;
+    s32 origin_lon;
+    s32 cos_q15;
+    struct gps_kalman_axis east;
+    struct gps_kalman_axis north;
+};
+
+/*
+* Single-producer, multi-consumer fix ring. Producers serialise on lock;
+* readers never take it and only touch their own cursor, so the cost of
+* a fix does not grow with the number of open files.
+*/
+struct gps_device
+{
+    struct gps_ring_slot ring[GPS_FIX_RING_SIZE];
+    u64 head;                   /* sequence number of the next fix */
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    struct hrtimer timer;
+    struct gps_filter filter;   /* under lock */
+    struct gps_latency_hist __percpu* lat_hist;
+    struct dentry* debugfs_dir;
+
+    /*
+    * Time-ordered history, written by the producer under lock and read
+    * lock-free by range queries. A fix older than the newest one already
+    * recorded is left out so timestamps stay sorted for binary search.
+    */
+    struct gps_fix_record* history;
+    u64 hist_head;              /* number of fixes ever recorded */
+    u64 hist_last_ts;
+
+    /*
+    * Geofences, indexed by a uniform grid of GPS_GRID_CELL_E7 cells so a
+    * fix is only tested against the fences near it plus the ones it is
+    * currently inside. Crossings go to their own ring and wait queue.
+    */
+    spinlock_t fence_lock;
+    DECLARE_HASHTABLE(fence_grid, GPS_GRID_HASH_BITS);
+    DECLARE_HASHTABLE(fence_ids, GPS_FENCE_ID_HASH_BITS);
+    struct list_head fence_inside;
+    u32 fence_count;
+    u64 fence_epoch;
+    struct gps_event_slot events[GPS_EVENT_RING_SIZE];
+    u64 event_head;
+    wait_queue_head_t fence_wait;
+    unsigned int sim_angle;
+
+    /* Recorded track, only modified while replay is stopped. */
+    struct mutex track_lock;
+    struct gps_fix_record* track;
+    u32 track_len;
+    u32 replay_pos;
+    u32 replay_rate;
+    u32 replay_flags;
+    bool replay_running;
+    u64 replay_start_ns;        /* monotonic time the current pass started */
+    u64 replay_base_ns;         /* UTC stamp given to track[0] in this pass */
+    u64 ingest_dropped;         /* fixes a failed flush lost, under track_lock */
+};
+
+/*
+* Per-file NMEA ingest state. Sentences may be split across writes, so
+* the current line is buffered. GGA, RMC and VTG sentences for the same
+* epoch are merged into one pending fix, which is emitted once both GGA
+* and RMC were seen or when a sentence for a new epoch arrives.
+*/
+struct gps_nmea_parser
+{
+    char line[GPS_NMEA_LINE_MAX + 1];
+    size_t line_len;
+    bool discard;               /* current line overflowed, skip to newline */
+    struct gps_fix_record pending;
+    u32 pending_tod_ms;
+    u32 pending_mask;           /* GPS_NMEA_HAVE_* */
+    u64 date_ns;                /* UTC midnight of the last RMC date */
+    struct gps_ingest_stats stats;
+};
+
+struct gps_client
+{
+    struct gps_device* gdev;
+    struct mutex read_lock;
+    int format;
+    u64 next_seq;
+    u64 next_event;
+    u64 lost;                   /* fixes or events skipped because the reader was lapped */
+    bool overrun;               /* flag the next record delivered */
+    char nmea[GPS_NMEA_FIX_MAX];
+    size_t nmea_len;
+    size_t nmea_off;
+
+    struct mutex write_lock;
+    int write_mode;
+    struct gps_nmea_parser parser;
+    struct gps_fix_record ingest[GPS_READ_BATCH];
+    int ingest_len;
+};
+
 /*****************************************
 *   Function Declarations.
 *****************************************/
@@ -19,21 +398,1713 @@ static int gps_dev_open(struct inode* inode, struct file* file);
 static int gps_dev_close(struct inode* inode, struct file* file);
 static ssize_t gps_dev_write(struct file* filep, const char __user* buffer, size_t count, loff_t* lofft);
 static ssize_t gps_dev_read(struct file* filep, char __user* buffer, size_t count, loff_t* lofft);
+static long gps_dev_ioctl(struct file* file, unsigned int cmd, unsigned long args);
+static __poll_t gps_dev_poll(struct file* file, poll_table* wait);
+static enum hrtimer_restart gps_timer_fn(struct hrtimer* timer);
+static void gps_sim_fix(struct gps_device* gdev, struct gps_fix_record* fix);
+static void gps_replay_start(struct gps_device* gdev, u32 rate, u32 flags);
+static void gps_replay_stop(struct gps_device* gdev);
+static void gps_publish_locked(struct gps_device* gdev, const struct gps_fix_record* fix);
+static void gps_wake_readers(struct gps_device* gdev, u64 fix_head, u64 event_head);
+static void gps_fence_eval(struct gps_device* gdev, const struct gps_fix_record* fix);
+static void gps_filter_apply(struct gps_filter* filter, struct gps_fix_record* fix);
+static s32 gps_cos_q15(s32 lat_e7);
+static int gps_fence_add(struct gps_device* gdev, const struct gps_fence_def* def);
+static int gps_fence_del(struct gps_device* gdev, u32 id);
+static void gps_fence_clear(struct gps_device* gdev);
+static int gps_fetch_fixes(struct gps_client* client, struct gps_fix_record* fixes, int max);
+static ssize_t gps_read_binary(struct gps_client* client, char __user* buffer, size_t count);
+static ssize_t gps_read_nmea(struct gps_client* client, char __user* buffer, size_t count);
+static ssize_t gps_read_events(struct gps_client* client, char __user* buffer, size_t count);
+static ssize_t gps_write_binary(struct gps_client* client, const char __user* buffer, size_t count);
+static ssize_t gps_write_nmea(struct gps_client* client, const char __user* buffer, size_t count);
+static int gps_ingest_flush(struct gps_client* client);
+static size_t gps_nmea_format(const struct gps_fix_record* fix, char* buf, size_t size);
+
+/*****************************************
+*   Global variable Declarations.
+*****************************************/
+dev_t gps_dev_no;
+struct cdev gps_dev_cdev;
+struct class* gps_dev_class;
+struct gps_device gps_dev_state;
+struct file_operations gps_dev_f_ops =
+{
+    .owner          = THIS_MODULE,
+    .read           = gps_dev_read,
+    .write          = gps_dev_write,
+    .open           = gps_dev_open,
+    .release        = gps_dev_close,
+    .poll           = gps_dev_poll,
+    .unlocked_ioctl = gps_dev_ioctl
+};
+
+/*****************************************
+*   Fix Generation.
+*****************************************/
+static void gps_sim_fix(struct gps_device* gdev, struct gps_fix_record* fix)
+{
+    int cos_q15, sin_q15;
+    u32 radius_mm;
+
+    cos_q15 = fixp_cos16(gdev->sim_angle);
+    sin_q15 = fixp_sin16(gdev->sim_angle);
+    radius_mm = GPS_SIM_RADIUS_E7 * GPS_MM_PER_E7_NUM / GPS_MM_PER_E7_DEN;
+
+    memset(fix, 0, sizeof(*fix));
+
+    fix->timestamp_ns = ktime_get_real_ns();
+    fix->lat_e7 = GPS_SIM_BASE_LAT_E7 + ((GPS_SIM_RADIUS_E7 * cos_q15) >> 15);
+    fix->lon_e7 = GPS_SIM_BASE_LON_E7 + ((GPS_SIM_RADIUS_E7 * sin_q15) >> 15);
+    fix->alt_mm = GPS_SIM_ALT_MM;
+    /* Arc length of one step (2 * pi * r * step / 360) per interval. */
+    fix->speed_mmps = (u32)div_u64((u64)radius_mm * GPS_SIM_STEP_DEG * 31416 * 1000,
+                                   18000 * 100 * GPS_FIX_INTERVAL_MS);
+    fix->course_cdeg = ((gdev->sim_angle + 90) % 360) * 100;
+    fix->hdop_c = GPS_SIM_HDOP_C;
+    fix->quality = GPS_QUALITY_GPS;
+    fix->num_sats = GPS_SIM_SATS;
+
+    gdev->sim_angle = (gdev->sim_angle + GPS_SIM_STEP_DEG) % 360;
+}
+
+/*
+* Called with gdev->lock held. Readers see the fix once head moves past it.
+* Every fix, simulated, replayed or written, passes the smoothing stage
+* here, so it runs once per fix however many readers there are.
+*/
+static void gps_publish_locked(struct gps_device* gdev, const struct gps_fix_record* fix)
+{
+    struct gps_ring_slot* slot = &gdev->ring[gdev->head & GPS_FIX_RING_MASK];
+
+    WRITE_ONCE(slot->seq, 0);
+    smp_wmb();
+    slot->fix = *fix;
+    gps_filter_apply(&gdev->filter, &slot->fix);
+    slot->fix.gen_ns = ktime_get_ns();
+    slot->fix.read_ns = 0;
+    smp_store_release(&slot->seq, gdev->head + 1);
+    smp_store_release(&gdev->head, gdev->head + 1);
+
+    if(slot->fix.timestamp_ns >= gdev->hist_last_ts)
+    {
+        gdev->history[gdev->hist_head & GPS_HISTORY_MASK] = slot->fix;
+        gdev->hist_last_ts = slot->fix.timestamp_ns;
+        smp_store_release(&gdev->hist_head, gdev->hist_head + 1);
+    }
+
+    gps_fence_eval(gdev, &slot->fix);
+}
+
+/* Wake fix and event readers if anything was published since the heads given. */
+static void gps_wake_readers(struct gps_device* gdev, u64 fix_head, u64 event_head)
+{
+    if(smp_load_acquire(&gdev->head) != fix_head)
+    {
+        wake_up_interruptible(&gdev->wait);
+    }
+
+    if(smp_load_acquire(&gdev->event_head) != event_head)
+    {
+        wake_up_interruptible(&gdev->fence_wait);
+    }
+}
+
+/* Monotonic time at which track[pos] is due in the current replay pass. */
+static u64 gps_replay_due_ns(struct gps_device* gdev, u32 pos)
+{
+    return gdev->replay_start_ns +
+           div_u64(gdev->track[pos].timestamp_ns - gdev->track[0].timestamp_ns,
+                   gdev->replay_rate);
+}
+
+/*
+* Single producer for the fix ring. While a replay is running every track
+* fix that has come due is published in one pass, so at high playback
+* rates the timer fires at most every GPS_REPLAY_MIN_TICK_NS and publishes
+* a batch. Readers are woken once per expiry, not once per fix.
+* Replayed fixes keep their recorded spacing in timestamp_ns, rebased so
+* the first fix of each pass carries the UTC time it started.
+*/
+static enum hrtimer_restart gps_timer_fn(struct hrtimer* timer)
+{
+    struct gps_device* gdev = container_of(timer, struct gps_device, timer);
+    struct gps_fix_record fix;
+    u64 now, due, span, start_head, start_events;
+
+    if(!READ_ONCE(gdev->replay_running))
+    {
+        gps_sim_fix(gdev, &fix);
+
+        spin_lock(&gdev->lock);
+        start_head = gdev->head;
+        start_events = gdev->event_head;
+        gps_publish_locked(gdev, &fix);
+        spin_unlock(&gdev->lock);
+
+        gps_wake_readers(gdev, start_head, start_events);
+
+        hrtimer_forward_now(timer, ms_to_ktime(GPS_FIX_INTERVAL_MS));
+
+        return HRTIMER_RESTART;
+    }
+
+    now = ktime_get_ns();
+
+    spin_lock(&gdev->lock);
+
+    start_head = gdev->head;
+    start_events = gdev->event_head;
+
+    while(gdev->replay_pos < gdev->track_len &&
+          gps_replay_due_ns(gdev, gdev->replay_pos) <= now)
+    {
+        fix = gdev->track[gdev->replay_pos];
+        fix.timestamp_ns = gdev->replay_base_ns +
+                           (fix.timestamp_ns - gdev->track[0].timestamp_ns);
+        gps_publish_locked(gdev, &fix);
+        gdev->replay_pos++;
+    }
+
+    spin_unlock(&gdev->lock);
+
+    gps_wake_readers(gdev, start_head, start_events);
+
+    if(gdev->replay_pos >= gdev->track_len)
+    {
+        if(!(gdev->replay_flags & GPS_REPLAY_LOOP))
+        {
+            /* Track finished: fall back to the simulated receiver. */
+            WRITE_ONCE(gdev->replay_running, false);
+            hrtimer_forward_now(timer, ms_to_ktime(GPS_FIX_INTERVAL_MS));
+
+            return HRTIMER_RESTART;
+        }
+
+        /* Start the next pass one fix interval after the last fix. */
+        span = gdev->track[gdev->track_len - 1].timestamp_ns -
+               gdev->track[0].timestamp_ns + GPS_FIX_INTERVAL_MS * NSEC_PER_MSEC;
+        gdev->replay_base_ns += span;
+        gdev->replay_start_ns += div_u64(span, gdev->replay_rate);
+        gdev->replay_pos = 0;
+    }
+
+    due = max_t(u64, gps_replay_due_ns(gdev, gdev->replay_pos), now + GPS_REPLAY_MIN_TICK_NS);
+    hrtimer_set_expires(timer, ns_to_ktime(due));
+
+    return HRTIMER_RESTART;
+}
+
+/* Called with track_lock held and a non-empty track. */
+static void gps_replay_start(struct gps_device* gdev, u32 rate, u32 flags)
+{
+    hrtimer_cancel(&gdev->timer);
+
+    gdev->replay_rate = rate;
+    gdev->replay_flags = flags;
+    gdev->replay_pos = 0;
+    gdev->replay_start_ns = ktime_get_ns();
+    gdev->replay_base_ns = ktime_get_real_ns();
+    WRITE_ONCE(gdev->replay_running, true);
+
+    hrtimer_start(&gdev->timer, ns_to_ktime(gdev->replay_start_ns), HRTIMER_MODE_ABS_SOFT);
+}
+
+/* Called with track_lock held. */
+static void gps_replay_stop(struct gps_device* gdev)
+{
+    hrtimer_cancel(&gdev->timer);
+
+    WRITE_ONCE(gdev->replay_running, false);
+
+    hrtimer_start(&gdev->timer, ms_to_ktime(GPS_FIX_INTERVAL_MS), HRTIMER_MODE_REL_SOFT);
+}
+
+/*
+* A lapped reader never holds the producer back: it drops to half a ring
+* behind head, counts what it missed and flags the next record it gets.
+*/
+static void gps_client_overrun(struct gps_client* client, u64 head)
+{
+    u64 resume = head - GPS_FIX_RING_SIZE / 2;
+
+    if(resume > client->next_seq)
+    {
+        client->lost += resume - client->next_seq;
+        client->next_seq = resume;
+        client->overrun = true;
+    }
+}
+
+static void gps_latency_record(struct gps_device* gdev, u64 latency_ns)
+{
+    unsigned int b = latency_ns ? min_t(unsigned int, ilog2(latency_ns), GPS_LAT_BUCKETS - 1) : 0;
+
+    this_cpu_inc(gdev->lat_hist->bucket[b]);
+}
+
+/* Copy up to max fixes the client has not seen yet, without taking any lock. */
+static int gps_fetch_fixes(struct gps_client* client, struct gps_fix_record* fixes, int max)
+{
+    struct gps_device* gdev = client->gdev;
+    struct gps_ring_slot* slot;
+    u64 head, seq, now;
+    int n = 0;
+
+    head = smp_load_acquire(&gdev->head);
+    now = ktime_get_ns();
+
+    while(n < max && client->next_seq < head)
+    {
+        if(head - client->next_seq > GPS_FIX_RING_SIZE)
+        {
+            gps_client_overrun(client, head);
+        }
+
+        slot = &gdev->ring[client->next_seq & GPS_FIX_RING_MASK];
+
+        seq = smp_load_acquire(&slot->seq);
+        fixes[n] = slot->fix;
+        smp_rmb();
+
+        if(seq != client->next_seq + 1 || READ_ONCE(slot->seq) != seq)
+        {
+            /* Overwritten while we were copying it. */
+            head = smp_load_acquire(&gdev->head);
+            gps_client_overrun(client, head);
+
+            continue;
+        }
+
+        if(client->overrun)
+        {
+            fixes[n].flags |= GPS_FIX_FLAG_OVERRUN;
+            client->overrun = false;
+        }
+
+        fixes[n].read_ns = now;
+        gps_latency_record(gdev, now - fixes[n].gen_ns);
+
+        client->next_seq++;
+        n++;
+    }
+
+    return n;
+}
+
+/* Copy up to max fence events the client has not seen yet, without taking any lock. */
+static int gps_fetch_events(struct gps_client* client, struct gps_fence_event* events, int max)
+{
+    struct gps_device* gdev = client->gdev;
+    struct gps_event_slot* slot;
+    u64 head, seq, resume;
+    int n = 0;
+
+    head = smp_load_acquire(&gdev->event_head);
+
+    while(n < max && client->next_event < head)
+    {
+        slot = &gdev->events[client->next_event & GPS_EVENT_RING_MASK];
+
+        seq = smp_load_acquire(&slot->seq);
+        events[n] = slot->event;
+        smp_rmb();
+
+        if(seq != client->next_event + 1 || READ_ONCE(slot->seq) != seq)
+        {
+            head = smp_load_acquire(&gdev->event_head);
+            resume = head - GPS_EVENT_RING_SIZE / 2;
+
+            if(resume > client->next_event)
+            {
+                client->lost += resume - client->next_event;
+                client->next_event = resume;
+            }
+
+            continue;
+        }
+
+        client->next_event++;
+        n++;
+    }
+
+    return n;
+}
+
+static bool gps_client_ready(struct gps_client* client)
+{
+    if(GPS_FORMAT_FENCE_EVENTS == client->format)
+    {
+        return smp_load_acquire(&client->gdev->event_head) != client->next_event;
+    }
+
+    return client->nmea_off < client->nmea_len ||
+           smp_load_acquire(&client->gdev->head) != client->next_seq;
+}
+
+static wait_queue_head_t* gps_client_wq(struct gps_client* client)
+{
+    if(GPS_FORMAT_FENCE_EVENTS == client->format)
+    {
+        return &client->gdev->fence_wait;
+    }
+
+    return &client->gdev->wait;
+}
+
+/*****************************************
+*   Geofences.
+*****************************************/
+/* cos(latitude) in Q15, interpolated between whole degrees. */
+static s32 gps_cos_q15(s32 lat_e7)
+{
+    u32 abs_e7 = (lat_e7 < 0) ? -lat_e7 : lat_e7;
+    u32 deg = abs_e7 / 10000000;
+    s32 c0 = fixp_cos16(deg);
+    s32 c1 = fixp_cos16(deg + 1);
+
+    return c0 + (s32)div_s64((s64)(c1 - c0) * (abs_e7 % 10000000), 10000000);
+}
+
+static s32 gps_grid_coord(s32 e7)
+{
+    /* Floor division so cells do not straddle the equator or meridian. */
+    return (e7 >= 0) ? e7 / GPS_GRID_CELL_E7 : -((-e7 + GPS_GRID_CELL_E7 - 1) / GPS_GRID_CELL_E7);
+}
+
+static u64 gps_grid_key(s32 cell_lat, s32 cell_lon)
+{
+    return ((u64)(u32)cell_lat << 32) | (u32)cell_lon;
+}
+
+/* Ray casting in the lat/lon plane; the point is known to be inside the bounding box. */
+static bool gps_polygon_contains(const struct gps_fence_def* def, s32 lat, s32 lon)
+{
+    const struct gps_fence_point* v = def->vertices;
+    bool inside = false;
+    s64 lhs, rhs;
+    u32 i, j;
+
+    for(i = 0, j = def->num_vertices - 1; i < def->num_vertices; j = i++)
+    {
+        if((v[i].lat_e7 > lat) == (v[j].lat_e7 > lat))
+        {
+            continue;
+        }
+
+        lhs = (s64)(lon - v[i].lon_e7) * (v[j].lat_e7 - v[i].lat_e7);
+        rhs = (s64)(lat - v[i].lat_e7) * (v[j].lon_e7 - v[i].lon_e7);
+
+        if((v[j].lat_e7 > v[i].lat_e7) ? (lhs < rhs) : (lhs > rhs))
+        {
+            inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+static bool gps_fence_contains(const struct gps_fence* fence, s32 lat, s32 lon)
+{
+    s64 dx, dy;
+
+    if(lat < fence->min_lat || lat > fence->max_lat ||
+       lon < fence->min_lon || lon > fence->max_lon)
+    {
+        return false;
+    }
+
+    if(GPS_FENCE_POLYGON == fence->def.type)
+    {
+        return gps_polygon_contains(&fence->def, lat, lon);
+    }
+
+    /* Equirectangular distance in mm, good to well under 1% at fence scale. */
+    dy = (s64)(lat - fence->def.center.lat_e7) * GPS_MM_PER_E7_NUM / GPS_MM_PER_E7_DEN;
+    dx = (s64)(lon - fence->def.center.lon_e7) * GPS_MM_PER_E7_NUM / GPS_MM_PER_E7_DEN;
+    dx = (dx * fence->cos_q15) >> 15;
+
+    return dx * dx + dy * dy <= (s64)fence->def.radius_mm * fence->def.radius_mm;
+}
+
+/* Called with gdev->lock held, so events have a single producer too. */
+static void gps_fence_emit(struct gps_device* gdev, const struct gps_fence* fence,
+     const struct gps_fix_record* fix, u32 type)
+{
+    struct gps_event_slot* slot = &gdev->events[gdev->event_head & GPS_EVENT_RING_MASK];
+
+    WRITE_ONCE(slot->seq, 0);
+    smp_wmb();
+    slot->event.timestamp_ns = fix->timestamp_ns;
+    slot->event.fence_id = fence->def.id;
+    slot->event.type = type;
+    slot->event.lat_e7 = fix->lat_e7;
+    slot->event.lon_e7 = fix->lon_e7;
+    smp_store_release(&slot->seq, gdev->event_head + 1);
+    smp_store_release(&gdev->event_head, gdev->event_head + 1);
+}
+
+/*
+* Test a new fix against the fences it is currently inside (for exits)
+* and the fences indexed in its grid cell (for entries). The epoch stops
+* a fence from being tested twice for the same fix.
+*/
+static void gps_fence_eval(struct gps_device* gdev, const struct gps_fix_record* fix)
+{
+    struct gps_fence *fence, *tmp;
+    struct gps_fence_ref* ref;
+    u64 key;
+
+    if(GPS_QUALITY_NO_FIX == fix->quality)
+    {
+        return;
+    }
+
+    key = gps_grid_key(gps_grid_coord(fix->lat_e7), gps_grid_coord(fix->lon_e7));
+
+    spin_lock(&gdev->fence_lock);
+
+    if(0 == gdev->fence_count)
+    {
+        spin_unlock(&gdev->fence_lock);
+
+        return;
+    }
+
+    gdev->fence_epoch++;
+
+    list_for_each_entry_safe(fence, tmp, &gdev->fence_inside, inside_node)
+    {
+        fence->epoch = gdev->fence_epoch;
+
+        if(!gps_fence_contains(fence, fix->lat_e7, fix->lon_e7))
+        {
+            fence->inside = false;
+            list_del_init(&fence->inside_node);
+            gps_fence_emit(gdev, fence, fix, GPS_FENCE_EXIT);
+        }
+    }
+
+    hash_for_each_possible(gdev->fence_grid, ref, node, key)
+    {
+        fence = ref->fence;
+
+        if(ref->key != key || fence->epoch == gdev->fence_epoch)
+        {
+            continue;
+        }
+
+        fence->epoch = gdev->fence_epoch;
+
+        if(gps_fence_contains(fence, fix->lat_e7, fix->lon_e7))
+        {
+            fence->inside = true;
+            list_add_tail(&fence->inside_node, &gdev->fence_inside);
+            gps_fence_emit(gdev, fence, fix, GPS_FENCE_ENTER);
+        }
+    }
+
+    spin_unlock(&gdev->fence_lock);
+}
+
+/* Caller holds fence_lock. */
+static struct gps_fence* gps_fence_find(struct gps_device* gdev, u32 id)
+{
+    struct gps_fence* fence;
+
+    hash_for_each_possible(gdev->fence_ids, fence, id_node, id)
+    {
+        if(fence->def.id == id)
+        {
+            return fence;
+        }
+    }
+
+    return NULL;
+}
+
+/* Caller holds fence_lock; the fence is freed by the caller after unlocking. */
+static void gps_fence_unlink(struct gps_device* gdev, struct gps_fence* fence)
+{
+    u32 i;
+
+    for(i = 0; i < fence->nrefs; i++)
+    {
+        hash_del(&fence->refs[i].node);
+    }
+
+    hash_del(&fence->id_node);
+    list_del_init(&fence->inside_node);
+    gdev->fence_count--;
+}
+
+static void gps_fence_free(struct gps_fence* fence)
+{
+    kfree(fence->refs);
+    kfree(fence);
+}
+
+static int gps_fence_bounds(struct gps_fence* fence)
+{
+    const struct gps_fence_def* def = &fence->def;
+    s64 dlat, dlon;
+    u32 i;
+
+    if(GPS_FENCE_CIRCLE == def->type)
+    {
+        if(0 == def->radius_mm || abs((s64)def->center.lat_e7) > GPS_FENCE_MAX_LAT_E7 ||
+           abs((s64)def->center.lon_e7) > 1800000000)
+        {
+            return -EINVAL;
+        }
+
+        fence->cos_q15 = gps_cos_q15(def->center.lat_e7);
+        dlat = div_s64((s64)def->radius_mm * GPS_MM_PER_E7_DEN, GPS_MM_PER_E7_NUM) + 1;
+        dlon = div_s64(dlat << 15, fence->cos_q15) + 1;
+
+        if(dlat > GPS_FENCE_MAX_CELLS * GPS_GRID_CELL_E7 ||
+           dlon > GPS_FENCE_MAX_CELLS * GPS_GRID_CELL_E7)
+        {
+            return -E2BIG;
+        }
+
+        fence->min_lat = def->center.lat_e7 - dlat;
+        fence->max_lat = def->center.lat_e7 + dlat;
+        fence->min_lon = def->center.lon_e7 - dlon;
+        fence->max_lon = def->center.lon_e7 + dlon;
+
+        return 0;
+    }
+
+    if(GPS_FENCE_POLYGON != def->type ||
+       def->num_vertices < 3 || def->num_vertices > GPS_FENCE_MAX_VERTICES)
+    {
+        return -EINVAL;
+    }
+
+    fence->min_lat = fence->max_lat = def->vertices[0].lat_e7;
+    fence->min_lon = fence->max_lon = def->vertices[0].lon_e7;
+
+    for(i = 0; i < def->num_vertices; i++)
+    {
+        if(abs((s64)def->vertices[i].lat_e7) > GPS_FENCE_MAX_LAT_E7 ||
+           abs((s64)def->vertices[i].lon_e7) > 1800000000)
+        {
+            return -EINVAL;
+        }
+
+        fence->min_lat = min(fence->min_lat, def->vertices[i].lat_e7);
+        fence->max_lat = max(fence->max_lat, def->vertices[i].lat_e7);
+        fence->min_lon = min(fence->min_lon, def->vertices[i].lon_e7);
+        fence->max_lon = max(fence->max_lon, def->vertices[i].lon_e7);
+    }
+
+    return 0;
+}
+
+static int gps_fence_add(struct gps_device* gdev, const struct gps_fence_def* def)
+{
+    struct gps_fence* fence;
+    s32 lat0, lat1, lon0, lon1, cy, cx;
+    u64 cells;
+    u32 i;
+    int ret;
+
+    fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+
+    if(NULL == fence)
+    {
+        return -ENOMEM;
+    }
+
+    fence->def = *def;
+    INIT_LIST_HEAD(&fence->inside_node);
+
+    ret = gps_fence_bounds(fence);
+
+    if(ret)
+    {
+        goto err;
+    }
+
+    lat0 = gps_grid_coord(fence->min_lat);
+    lat1 = gps_grid_coord(fence->max_lat);
+    lon0 = gps_grid_coord(fence->min_lon);
+    lon1 = gps_grid_coord(fence->max_lon);
+    cells = (u64)(lat1 - lat0 + 1) * (lon1 - lon0 + 1);
+
+    if(cells > GPS_FENCE_MAX_CELLS)
+    {
+        ret = -E2BIG;
+
+        goto err;
+    }
+
+    fence->refs = kcalloc(cells, sizeof(struct gps_fence_ref), GFP_KERNEL);
+
+    if(NULL == fence->refs)
+    {
+        ret = -ENOMEM;
+
+        goto err;
+    }
+
+    fence->nrefs = cells;
+    i = 0;
+
+    for(cy = lat0; cy <= lat1; cy++)
+    {
+        for(cx = lon0; cx <= lon1; cx++)
+        {
+            fence->refs[i].key = gps_grid_key(cy, cx);
+            fence->refs[i].fence = fence;
+            i++;
+        }
+    }
+
+    spin_lock_bh(&gdev->fence_lock);
+
+    if(gps_fence_find(gdev, def->id))
+    {
+        ret = -EEXIST;
+    }
+    else if(gdev->fence_count >= GPS_FENCE_MAX)
+    {
+        ret = -ENOSPC;
+    }
+    else
+    {
+        for(i = 0; i < fence->nrefs; i++)
+        {
+            hash_add(gdev->fence_grid, &fence->refs[i].node, fence->refs[i].key);
+        }
+
+        hash_add(gdev->fence_ids, &fence->id_node, def->id);
+        gdev->fence_count++;
+    }
+
+    spin_unlock_bh(&gdev->fence_lock);
+
+    if(ret)
+    {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    gps_fence_free(fence);
+
+    return ret;
+}
+
+static int gps_fence_del(struct gps_device* gdev, u32 id)
+{
+    struct gps_fence* fence;
+
+    spin_lock_bh(&gdev->fence_lock);
+
+    fence = gps_fence_find(gdev, id);
+
+    if(fence)
+    {
+        gps_fence_unlink(gdev, fence);
+    }
+
+    spin_unlock_bh(&gdev->fence_lock);
+
+    if(NULL == fence)
+    {
+        return -ENOENT;
+    }
+
+    gps_fence_free(fence);
+
+    return 0;
+}
+
+static void gps_fence_clear(struct gps_device* gdev)
+{
+    struct gps_fence* fence;
+    struct hlist_node* tmp;
+    LIST_HEAD(dead);
+    int bkt;
+
+    spin_lock_bh(&gdev->fence_lock);
+
+    hash_for_each_safe(gdev->fence_ids, bkt, tmp, fence, id_node)
+    {
+        gps_fence_unlink(gdev, fence);
+        list_add(&fence->inside_node, &dead);
+    }
+
+    spin_unlock_bh(&gdev->fence_lock);
+
+    while(!list_empty(&dead))
+    {
+        fence = list_first_entry(&dead, struct gps_fence, inside_node);
+        list_del(&fence->inside_node);
+        gps_fence_free(fence);
+    }
+}
+
+/*****************************************
+*   Kalman Smoothing.
+*****************************************/
+static s64 gps_filter_clamp_var(s64 v)
+{
+    return clamp_t(s64, v, -GPS_FILTER_MAX_VAR, GPS_FILTER_MAX_VAR);
+}
+
+static void gps_kalman_init(struct gps_kalman_axis* axis, s64 pos, s64 r)
+{
+    axis->pos = pos;
+    axis->vel = 0;
+    axis->p00 = r;
+    axis->p01 = 0;
+    axis->p11 = (s64)GPS_FILTER_INIT_VEL * GPS_FILTER_INIT_VEL;
+}
+
+/*
+* Advance one axis by dt_ms under a white-noise acceleration model with
+* spectral density q (mm^2/s^3), then fold in measurement z with
+* variance r. Gains are Q16 fractions.
+*/
+static void gps_kalman_step(struct gps_kalman_axis* axis, s64 dt_ms, s64 q, s64 z, s64 r)
+{
+    s64 qdt = div_s64(q * dt_ms, 1000);
+    s64 innov, s, k0, k1;
+
+    axis->pos += div_s64(axis->vel * dt_ms, 1000);
+    axis->p00 += div_s64(2 * axis->p01 * dt_ms, 1000) +
+                 div_s64(div_s64(axis->p11 * dt_ms, 1000) * dt_ms, 1000) +
+                 div_s64(div_s64(qdt * dt_ms, 1000) * dt_ms, 3000);
+    axis->p01 += div_s64(axis->p11 * dt_ms, 1000) + div_s64(qdt * dt_ms, 2000);
+    axis->p11 += qdt;
+
+    axis->p00 = gps_filter_clamp_var(axis->p00);
+    axis->p01 = gps_filter_clamp_var(axis->p01);
+    axis->p11 = gps_filter_clamp_var(axis->p11);
+
+    s = axis->p00 + r;
+    k0 = div64_s64(axis->p00 * GPS_Q16_ONE, s);
+    k1 = div64_s64(axis->p01 * GPS_Q16_ONE, s);
+    innov = z - axis->pos;
+
+    axis->pos += (k0 * innov) >> 16;
+    axis->vel += (k1 * innov) >> 16;
+    axis->p11 -= (k1 * axis->p01) >> 16;
+    axis->p01 -= (k0 * axis->p01) >> 16;
+    axis->p00 -= (k0 * axis->p00) >> 16;
+
+    /* A large gain on a wild fix can throw the estimate far off; keep vel * vel representable. */
+    axis->vel = clamp_t(s64, axis->vel, -GPS_FILTER_MAX_VEL, GPS_FILTER_MAX_VEL);
+}
+
+/* Called with gdev->lock held. Replaces position and speed with the filtered estimate. */
+static void gps_filter_apply(struct gps_filter* filter, struct gps_fix_record* fix)
+{
+    s64 sigma, r, q, dt_ms, east_mm, north_mm;
+    u64 speed2;
+
+    if(!filter->cfg.enable || GPS_QUALITY_NO_FIX == fix->quality ||
+       abs((s64)fix->lat_e7) > GPS_FILTER_MAX_LAT_E7)
+    {
+        return;
+    }
+
+    sigma = (s64)filter->cfg.sigma_mm * (fix->hdop_c ? fix->hdop_c : 100) / 100;
+    sigma = clamp_t(s64, sigma, 1, GPS_FILTER_MAX_SIGMA_MM);
+    r = sigma * sigma;
+
+    /* Restart on the first fix, after a gap, when time runs backwards or far from the origin. */
+    if(!filter->primed || fix->timestamp_ns < filter->last_ts ||
+       fix->timestamp_ns - filter->last_ts > (u64)filter->cfg.reset_gap_ms * NSEC_PER_MSEC ||
+       abs((s64)fix->lat_e7 - filter->origin_lat) > GPS_FILTER_MAX_SPAN_E7 ||
+       abs((s64)fix->lon_e7 - filter->origin_lon) > GPS_FILTER_MAX_SPAN_E7)
+    {
+        filter->origin_lat = fix->lat_e7;
+        filter->origin_lon = fix->lon_e7;
+        filter->cos_q15 = gps_cos_q15(fix->lat_e7);
+        filter->last_ts = fix->timestamp_ns;
+        filter->primed = true;
+        gps_kalman_init(&filter->east, 0, r);
+        gps_kalman_init(&filter->north, 0, r);
+        fix->flags |= GPS_FIX_FLAG_FILTERED;
+
+        return;
+    }
+
+    dt_ms = div_u64(fix->timestamp_ns - filter->last_ts, NSEC_PER_MSEC);
+    filter->last_ts = fix->timestamp_ns;
+
+    north_mm = ((s64)fix->lat_e7 - filter->origin_lat) * GPS_MM_PER_E7_NUM / GPS_MM_PER_E7_DEN;
+    east_mm = ((((s64)fix->lon_e7 - filter->origin_lon) * GPS_MM_PER_E7_NUM / GPS_MM_PER_E7_DEN) *
+               filter->cos_q15) >> 15;
+    q = (s64)filter->cfg.accel_mmps2 * filter->cfg.accel_mmps2;
+
+    gps_kalman_step(&filter->north, dt_ms, q, north_mm, r);
+    gps_kalman_step(&filter->east, dt_ms, q, east_mm, r);
+
+    fix->lat_e7 = filter->origin_lat +
+                  (s32)div_s64(filter->north.pos * GPS_MM_PER_E7_DEN, GPS_MM_PER_E7_NUM);
+    fix->lon_e7 = filter->origin_lon +
+                  (s32)div64_s64(filter->east.pos * GPS_MM_PER_E7_DEN * 32768,
+                                 (s64)GPS_MM_PER_E7_NUM * filter->cos_q15);
+
+    /* Course is left as measured; speed comes from the velocity estimate. */
+    speed2 = (u64)(filter->east.vel * filter->east.vel) +
+             (u64)(filter->north.vel * filter->north.vel);
+    fix->speed_mmps = int_sqrt64(speed2);
+    fix->flags |= GPS_FIX_FLAG_FILTERED;
+}
+
+static int gps_filter_configure(struct gps_device* gdev, const struct gps_filter_cfg* cfg)
+{
+    if(cfg->enable > 1 || 0 == cfg->sigma_mm || cfg->sigma_mm > GPS_FILTER_MAX_SIGMA_MM ||
+       cfg->accel_mmps2 > GPS_FILTER_MAX_ACCEL || 0 == cfg->reset_gap_ms ||
+       cfg->reset_gap_ms > GPS_FILTER_MAX_GAP_MS)
+    {
+        return -EINVAL;
+    }
+
+    spin_lock_bh(&gdev->lock);
+    gdev->filter.cfg = *cfg;
+    gdev->filter.primed = false;
+    spin_unlock_bh(&gdev->lock);
+
+    return 0;
+}
+
+/*****************************************
+*   History Queries.
+*****************************************/
+/* First logical index in [lo, hi) whose timestamp is >= t (strictly > t if after). */
+static u64 gps_history_bound(struct gps_device* gdev, u64 lo, u64 hi, u64 t, bool after)
+{
+    u64 mid, ts;
+
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        ts = READ_ONCE(gdev->history[mid & GPS_HISTORY_MASK].timestamp_ns);
+
+        if(ts < t || (after && ts == t))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+* Binary-search the history for the requested window and copy the slice
+* straight to user space, in at most two chunks when it wraps. One slot
+* is kept as slack for the entry the producer may be rewriting; if the
+* producer lapped the searched window meanwhile, the query is retried.
+*/
+static int gps_history_query(struct gps_device* gdev, struct gps_range_query* q)
+{
+    struct gps_fix_record __user* out = u64_to_user_ptr(q->records);
+    u64 head, lo, first, end, n, chunk;
+    int retry;
+
+    for(retry = 0; retry < GPS_HISTORY_RETRIES; retry++)
+    {
+        head = smp_load_acquire(&gdev->hist_head);
+        lo = (head > GPS_HISTORY_LEN - 1) ? head - (GPS_HISTORY_LEN - 1) : 0;
+
+        first = gps_history_bound(gdev, lo, head, q->t_start_ns, false);
+        end = gps_history_bound(gdev, first, head, q->t_end_ns, true);
+        n = min_t(u64, end - first, q->max_records);
+
+        if(n > 0)
+        {
+            chunk = min_t(u64, n, GPS_HISTORY_LEN - (first & GPS_HISTORY_MASK));
+
+            if(copy_to_user(out, &gdev->history[first & GPS_HISTORY_MASK],
+                            chunk * sizeof(struct gps_fix_record)) ||
+               copy_to_user(out + chunk, gdev->history,
+                            (n - chunk) * sizeof(struct gps_fix_record)))
+            {
+                return -EFAULT;
+            }
+        }
+
+        smp_rmb();
+
+        if(READ_ONCE(gdev->hist_head) - lo < GPS_HISTORY_LEN)
+        {
+            q->count = n;
+            q->total = end - first;
+
+            return 0;
+        }
+    }
+
+    return -EAGAIN;
+}
+
+/*****************************************
+*   NMEA Formatting.
+*****************************************/
+static size_t gps_nmea_coord(char* buf, size_t size, s32 e7, bool is_lat)
+{
+    u32 abs_e7 = (e7 < 0) ? -e7 : e7;
+    u32 deg = abs_e7 / 10000000;
+    u32 min_e4 = (u32)div_u64((u64)(abs_e7 % 10000000) * 60, 1000);
+    char hemi;
+
+    if(is_lat)
+    {
+        hemi = (e7 < 0) ? 'S' : 'N';
+
+        return scnprintf(buf, size, "%02u%02u.%04u,%c", deg,
+                         min_e4 / 10000, min_e4 % 10000, hemi);
+    }
+
+    hemi = (e7 < 0) ? 'W' : 'E';
+
+    return scnprintf(buf, size, "%03u%02u.%04u,%c", deg,
+                     min_e4 / 10000, min_e4 % 10000, hemi);
+}
+
+/*
+* Terminate the sentence whose body starts after the '$' at buf[start]
+* with its checksum and CRLF.
+*/
+static size_t gps_nmea_finish(char* buf, size_t start, size_t len, size_t size)
+{
+    u8 csum = 0;
+    size_t i;
+
+    for(i = start + 1; i < len; i++)
+    {
+        csum ^= buf[i];
+    }
+
+    return len + scnprintf(buf + len, size - len, "*%02X\r\n", csum);
+}
+
+static size_t gps_nmea_format(const struct gps_fix_record* fix, char* buf, size_t size)
+{
+    struct tm tm;
+    u32 rem_ns, centi;
+    u32 abs_alt;
+    size_t len, start;
+    u64 secs;
+
+    secs = div_u64_rem(fix->timestamp_ns, NSEC_PER_SEC, &rem_ns);
+    time64_to_tm(secs, 0, &tm);
+    centi = rem_ns / 10000000;
+    abs_alt = (fix->alt_mm < 0) ? -fix->alt_mm : fix->alt_mm;
+
+    /* GGA: time, position, quality, satellites, HDOP, altitude. */
+    start = 0;
+    len = scnprintf(buf, size, "$GPGGA,%02d%02d%02d.%02u,",
+                    tm.tm_hour, tm.tm_min, tm.tm_sec, centi);
+    len += gps_nmea_coord(buf + len, size - len, fix->lat_e7, true);
+    len += scnprintf(buf + len, size - len, ",");
+    len += gps_nmea_coord(buf + len, size - len, fix->lon_e7, false);
+    len += scnprintf(buf + len, size - len, ",%u,%02u,%u.%02u,%s%u.%u,M,0.0,M,,",
+                     fix->quality, fix->num_sats,
+                     fix->hdop_c / 100, fix->hdop_c % 100,
+                     (fix->alt_mm < 0) ? "-" : "", abs_alt / 1000, (abs_alt % 1000) / 100);
+    len = gps_nmea_finish(buf, start, len, size);
+
+    /* RMC: time, status, position, speed (knots), course, date. */
+    start = len;
+    len += scnprintf(buf + len, size - len, "$GPRMC,%02d%02d%02d.%02u,%c,",
+                     tm.tm_hour, tm.tm_min, tm.tm_sec, centi,
+                     (fix->quality != GPS_QUALITY_NO_FIX) ? 'A' : 'V');
+    len += gps_nmea_coord(buf + len, size - len, fix->lat_e7, true);
+    len += scnprintf(buf + len, size - len, ",");
+    len += gps_nmea_coord(buf + len, size - len, fix->lon_e7, false);
+    /* mm/s to tenths of a knot: 3600 * 10 / (1852 * 1000). */
+    len += scnprintf(buf + len, size - len, ",%u.%u,%u.%02u,%02d%02d%02d,,,A",
+                     (fix->speed_mmps * 36 / 1852) / 10, (fix->speed_mmps * 36 / 1852) % 10,
+                     fix->course_cdeg / 100, fix->course_cdeg % 100,
+                     tm.tm_mday, tm.tm_mon + 1, (int)(tm.tm_year % 100));
+    len = gps_nmea_finish(buf, start, len, size);
+
+    return len;
+}
+
+/*****************************************
+*   Fix Ingest.
+*****************************************/
+/* Publish fixes written by user space to every reader, waking them once. */
+static void gps_publish_batch(struct gps_device* gdev, const struct gps_fix_record* fixes, int n)
+{
+    u64 start_head, start_events;
+    int i;
+
+    spin_lock_bh(&gdev->lock);
+
+    start_head = gdev->head;
+    start_events = gdev->event_head;
+
+    for(i = 0; i < n; i++)
+    {
+        gps_publish_locked(gdev, &fixes[i]);
+    }
+
+    spin_unlock_bh(&gdev->lock);
+
+    gps_wake_readers(gdev, start_head, start_events);
+}
+
+/* Called with track_lock held. */
+static int gps_track_reserve(struct gps_device* gdev)
+{
+    if(gdev->replay_running)
+    {
+        return -EBUSY;
+    }
+
+    if(NULL == gdev->track)
+    {
+        gdev->track = kvmalloc_array(GPS_TRACK_MAX_FIXES, sizeof(struct gps_fix_record), GFP_KERNEL);
+
+        if(NULL == gdev->track)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    return (gdev->track_len < GPS_TRACK_MAX_FIXES) ? 0 : -ENOSPC;
+}
+
+/* Called with track_lock held; checks the n records at the end of the track are in order. */
+static bool gps_track_ordered(struct gps_device* gdev, size_t n)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        if(gdev->track_len + i > 0 &&
+           gdev->track[gdev->track_len + i].timestamp_ns <
+           gdev->track[gdev->track_len + i - 1].timestamp_ns)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Hand the fixes collected from NMEA sentences to the write target. */
+static int gps_ingest_flush(struct gps_client* client)
+{
+    struct gps_device* gdev = client->gdev;
+    int n = client->ingest_len;
+    int ret;
+
+    if(0 == n)
+    {
+        return 0;
+    }
+
+    client->ingest_len = 0;
+
+    if(GPS_WRITE_LIVE == client->write_mode)
+    {
+        gps_publish_batch(gdev, client->ingest, n);
+
+        return 0;
+    }
+
+    mutex_lock(&gdev->track_lock);
+
+    ret = gps_track_reserve(gdev);
+
+    if(0 == ret && n > GPS_TRACK_MAX_FIXES - gdev->track_len)
+    {
+        ret = -ENOSPC;
+    }
+
+    if(0 == ret)
+    {
+        memcpy(&gdev->track[gdev->track_len], client->ingest, n * sizeof(struct gps_fix_record));
+
+        if(gps_track_ordered(gdev, n))
+        {
+            gdev->track_len += n;
+        }
+        else
+        {
+            ret = -EINVAL;
+        }
+    }
+
+    if(ret)
+    {
+        gdev->ingest_dropped += n;
+    }
+
+    mutex_unlock(&gdev->track_lock);
+
+    return ret;
+}
+
+static ssize_t gps_write_binary(struct gps_client* client,
+     const char __user* buffer, size_t count)
+{
+    struct gps_device* gdev = client->gdev;
+    struct gps_fix_record fixes[GPS_READ_BATCH];
+    size_t total, n, done;
+    ssize_t ret;
+
+    if(count % sizeof(struct gps_fix_record))
+    {
+        return -EINVAL;
+    }
+
+    total = count / sizeof(struct gps_fix_record);
+
+    if(GPS_WRITE_LIVE == client->write_mode)
+    {
+        for(done = 0; done < total; done += n)
+        {
+            n = min_t(size_t, total - done, GPS_READ_BATCH);
+
+            if(copy_from_user(fixes, buffer + done * sizeof(struct gps_fix_record),
+                              n * sizeof(struct gps_fix_record)))
+            {
+                return done ? done * sizeof(struct gps_fix_record) : -EFAULT;
+            }
+
+            gps_publish_batch(gdev, fixes, n);
+        }
+
+        return count;
+    }
+
+    /* Track records are copied straight from user space into place. */
+    mutex_lock(&gdev->track_lock);
+
+    ret = gps_track_reserve(gdev);
+
+    if(ret)
+    {
+        goto out;
+    }
+
+    n = min_t(size_t, total, GPS_TRACK_MAX_FIXES - gdev->track_len);
+
+    if(copy_from_user(&gdev->track[gdev->track_len], buffer, n * sizeof(struct gps_fix_record)))
+    {
+        ret = -EFAULT;
+
+        goto out;
+    }
+
+    if(!gps_track_ordered(gdev, n))
+    {
+        ret = -EINVAL;
+
+        goto out;
+    }
+
+    gdev->track_len += n;
+    ret = n * sizeof(struct gps_fix_record);
+
+out:
+    mutex_unlock(&gdev->track_lock);
+
+    return ret;
+}
+
+/*****************************************
+*   NMEA Ingest.
+*****************************************/
+/*
+* Parse an unsigned or negative decimal such as "4807.038" into an
+* integer scaled by 10^frac_digits, truncating any extra digits.
+*/
+static int gps_nmea_fixed(const char* s, int frac_digits, s64* out)
+{
+    bool neg = false, any = false;
+    int frac = -1;
+    s64 v = 0;
+
+    if('-' == *s)
+    {
+        neg = true;
+        s++;
+    }
+
+    for(; *s; s++)
+    {
+        if('.' == *s && frac < 0)
+        {
+            frac = 0;
+
+            continue;
+        }
+
+        if(*s < '0' || *s > '9' || v > S64_MAX / 100)
+        {
+            return -EINVAL;
+        }
+
+        any = true;
+
+        if(frac < 0)
+        {
+            v = v * 10 + (*s - '0');
+        }
+        else if(frac < frac_digits)
+        {
+            v = v * 10 + (*s - '0');
+            frac++;
+        }
+    }
+
+    if(!any)
+    {
+        return -EINVAL;
+    }
+
+    for(frac = max(frac, 0); frac < frac_digits; frac++)
+    {
+        v *= 10;
+    }
+
+    *out = neg ? -v : v;
+
+    return 0;
+}
+
+/* "ddmm.mmmm" (or "dddmm.mmmm") plus hemisphere into degrees * 1e7. */
+static int gps_nmea_angle(const char* value, const char* hemi, s32* out)
+{
+    s64 v, deg, min_e7;
+
+    if(gps_nmea_fixed(value, 7, &v) || v < 0)
+    {
+        return -EINVAL;
+    }
+
+    deg = div_s64(v, 1000000000);
+    min_e7 = v - deg * 1000000000;
+
+    if(deg > 180 || min_e7 >= 600000000)
+    {
+        return -EINVAL;
+    }
+
+    *out = (s32)(deg * 10000000 + div_s64(min_e7, 60));
+
+    if('S' == hemi[0] || 'W' == hemi[0])
+    {
+        *out = -*out;
+    }
+    else if('N' != hemi[0] && 'E' != hemi[0])
+    {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* "hhmmss.ss" into milliseconds since UTC midnight. */
+static int gps_nmea_tod(const char* value, u32* tod_ms)
+{
+    s64 v;
+    u32 hh, mm, ss_ms;
+
+    if(gps_nmea_fixed(value, 3, &v) || v < 0)
+    {
+        return -EINVAL;
+    }
+
+    hh = (u32)div_s64(v, 10000000);
+    mm = (u32)div_s64(v, 100000) % 100;
+    ss_ms = (u32)(v - div_s64(v, 100000) * 100000);
+
+    if(hh > 23 || mm > 59 || ss_ms >= 61000)
+    {
+        return -EINVAL;
+    }
+
+    *tod_ms = hh * 3600000 + mm * 60000 + ss_ms;
+
+    return 0;
+}
+
+/* "ddmmyy" into UTC midnight in ns. */
+static int gps_nmea_date(const char* value, u64* date_ns)
+{
+    u32 v, dd, mo, yy;
+
+    if(strlen(value) != 6 || kstrtou32(value, 10, &v))
+    {
+        return -EINVAL;
+    }
+
+    dd = v / 10000;
+    mo = (v / 100) % 100;
+    yy = v % 100;
+
+    if(dd < 1 || dd > 31 || mo < 1 || mo > 12)
+    {
+        return -EINVAL;
+    }
+
+    *date_ns = (u64)mktime64(yy < 80 ? 2000 + yy : 1900 + yy, mo, dd, 0, 0, 0) * NSEC_PER_SEC;
+
+    return 0;
+}
+
+/* UTC midnight at or before ns. The divisor needs 64 bits, do_div() takes 32. */
+static u64 gps_utc_midnight_ns(u64 ns)
+{
+    u64 rem;
+
+    div64_u64_rem(ns, 86400ULL * NSEC_PER_SEC, &rem);
+
+    return ns - rem;
+}
+
+static void gps_nmea_emit(struct gps_client* client)
+{
+    struct gps_nmea_parser* p = &client->parser;
+    u64 date_ns = p->date_ns;
+
+    if(0 == p->pending_mask)
+    {
+        return;
+    }
+
+    /* No RMC date seen yet: assume the sentence is from today. */
+    if(0 == date_ns)
+    {
+        date_ns = gps_utc_midnight_ns(ktime_get_real_ns());
+    }
+
+    p->pending.timestamp_ns = date_ns + (u64)p->pending_tod_ms * NSEC_PER_MSEC;
+    client->ingest[client->ingest_len++] = p->pending;
+    p->stats.fixes++;
+
+    memset(&p->pending, 0, sizeof(p->pending));
+    p->pending_mask = 0;
+}
+
+/* Start or continue the epoch for a timed sentence; emits the previous epoch if it changed. */
+static int gps_nmea_epoch(struct gps_client* client, const char* time_field)
+{
+    struct gps_nmea_parser* p = &client->parser;
+    u32 tod_ms;
+
+    if(gps_nmea_tod(time_field, &tod_ms))
+    {
+        return -EINVAL;
+    }
+
+    if(p->pending_mask && tod_ms != p->pending_tod_ms)
+    {
+        gps_nmea_emit(client);
+    }
+
+    p->pending_tod_ms = tod_ms;
+
+    return 0;
+}
+
+static int gps_nmea_gga(struct gps_client* client, char** f, int nf)
+{
+    struct gps_fix_record* fix = &client->parser.pending;
+    s64 v;
+
+    if(nf < 10 || gps_nmea_epoch(client, f[1]))
+    {
+        return -EINVAL;
+    }
+
+    if(f[2][0] && (gps_nmea_angle(f[2], f[3], &fix->lat_e7) ||
+                   gps_nmea_angle(f[4], f[5], &fix->lon_e7)))
+    {
+        return -EINVAL;
+    }
+
+    if(0 == gps_nmea_fixed(f[6], 0, &v))
+    {
+        fix->quality = (u8)clamp_t(s64, v, 0, 255);
+    }
+
+    if(0 == gps_nmea_fixed(f[7], 0, &v))
+    {
+        fix->num_sats = (u8)clamp_t(s64, v, 0, 255);
+    }
+
+    if(0 == gps_nmea_fixed(f[8], 2, &v))
+    {
+        fix->hdop_c = (u16)clamp_t(s64, v, 0, U16_MAX);
+    }
+
+    if(0 == gps_nmea_fixed(f[9], 3, &v))
+    {
+        fix->alt_mm = (s32)clamp_t(s64, v, S32_MIN, S32_MAX);
+    }
+
+    client->parser.pending_mask |= GPS_NMEA_HAVE_GGA;
+
+    return 0;
+}
+
+static void gps_nmea_speed_course(struct gps_fix_record* fix, const char* knots, const char* course)
+{
+    s64 v;
+
+    /* Thousandths of a knot to mm/s: 1852000 / 3600 / 1000. */
+    if(0 == gps_nmea_fixed(knots, 3, &v) && v >= 0)
+    {
+        fix->speed_mmps = (u32)min_t(s64, div_s64(v * 1852, 3600), U32_MAX);
+    }
+
+    if(0 == gps_nmea_fixed(course, 2, &v) && v >= 0)
+    {
+        fix->course_cdeg = (u16)(v % 36000);
+    }
+}
+
+static int gps_nmea_rmc(struct gps_client* client, char** f, int nf)
+{
+    struct gps_nmea_parser* p = &client->parser;
+    struct gps_fix_record* fix = &p->pending;
+    u64 date_ns;
+
+    if(nf < 10 || gps_nmea_epoch(client, f[1]))
+    {
+        return -EINVAL;
+    }
+
+    if(0 == gps_nmea_date(f[9], &date_ns))
+    {
+        p->date_ns = date_ns;
+    }
+
+    if(f[3][0] && (gps_nmea_angle(f[3], f[4], &fix->lat_e7) ||
+                   gps_nmea_angle(f[5], f[6], &fix->lon_e7)))
+    {
+        return -EINVAL;
+    }
+
+    /* GGA carries the finer-grained quality; RMC only says valid or not. */
+    if(!(p->pending_mask & GPS_NMEA_HAVE_GGA))
+    {
+        fix->quality = ('A' == f[2][0]) ? GPS_QUALITY_GPS : GPS_QUALITY_NO_FIX;
+    }
+
+    gps_nmea_speed_course(fix, f[7], f[8]);
+
+    p->pending_mask |= GPS_NMEA_HAVE_RMC;
+
+    return 0;
+}
+
+static int gps_nmea_vtg(struct gps_client* client, char** f, int nf)
+{
+    struct gps_nmea_parser* p = &client->parser;
+
+    /* VTG has no time of its own; it belongs to the epoch in progress. */
+    if(nf < 8 || 0 == p->pending_mask)
+    {
+        return -EINVAL;
+    }
+
+    gps_nmea_speed_course(&p->pending, f[5], f[1]);
+
+    p->pending_mask |= GPS_NMEA_HAVE_VTG;
+
+    return 0;
+}
+
+/* Validate and decode one complete sentence held in the parser's line buffer. */
+static void gps_nmea_sentence(struct gps_client* client)
+{
+    struct gps_nmea_parser* p = &client->parser;
+    char* fields[GPS_NMEA_MAX_FIELDS];
+    char *line = p->line, *star, *cursor;
+    u8 csum = 0;
+    int nf = 0, ret = -EINVAL;
+    size_t len;
+    char* c;
+
+    line[p->line_len] = '\0';
+    star = strrchr(line, '*');
+
+    if('$' != line[0] || NULL == star || hex_to_bin(star[1]) < 0 || hex_to_bin(star[2]) < 0)
+    {
+        p->stats.malformed++;
+
+        return;
+    }
+
+    for(c = line + 1; c < star; c++)
+    {
+        csum ^= *c;
+    }
+
+    if(csum != ((hex_to_bin(star[1]) << 4) | hex_to_bin(star[2])))
+    {
+        p->stats.bad_checksum++;
+
+        return;
+    }
+
+    p->stats.sentences++;
+    *star = '\0';
+    cursor = line + 1;
+
+    while(cursor && nf < GPS_NMEA_MAX_FIELDS)
+    {
+        fields[nf++] = strsep(&cursor, ",");
+    }
+
+    /* Match on the sentence type and ignore the talker (GP, GN, GL, ...). */
+    len = strlen(fields[0]);
+
+    if(len == 5 && 0 == strcmp(fields[0] + 2, "GGA"))
+    {
+        ret = gps_nmea_gga(client, fields, nf);
+    }
+    else if(len == 5 && 0 == strcmp(fields[0] + 2, "RMC"))
+    {
+        ret = gps_nmea_rmc(client, fields, nf);
+    }
+    else if(len == 5 && 0 == strcmp(fields[0] + 2, "VTG"))
+    {
+        ret = gps_nmea_vtg(client, fields, nf);
+    }
+    else
+    {
+        /* GSA, GSV and friends carry nothing the fix record needs. */
+        ret = 0;
+    }
+
+    if(ret)
+    {
+        p->stats.malformed++;
+
+        return;
+    }
+
+    if((p->pending_mask & (GPS_NMEA_HAVE_GGA | GPS_NMEA_HAVE_RMC)) ==
+       (GPS_NMEA_HAVE_GGA | GPS_NMEA_HAVE_RMC))
+    {
+        gps_nmea_emit(client);
+    }
+}
+
+static ssize_t gps_write_nmea(struct gps_client* client,
+     const char __user* buffer, size_t count)
+{
+    struct gps_nmea_parser* p = &client->parser;
+    char chunk[GPS_NMEA_WRITE_CHUNK];
+    size_t done, n, i;
+    int ret;
+
+    for(done = 0; done < count; done += n)
+    {
+        n = min_t(size_t, count - done, sizeof(chunk));
+
+        if(copy_from_user(chunk, buffer + done, n))
+        {
+            return done ? done : -EFAULT;
+        }
+
+        for(i = 0; i < n; i++)
+        {
+            if('\r' == chunk[i] || '\n' == chunk[i])
+            {
+                if(p->line_len > 0 && !p->discard)
+                {
+                    gps_nmea_sentence(client);
+                }
+
+                p->line_len = 0;
+                p->discard = false;
+            }
+            else if('$' == chunk[i])
+            {
+                /* A new sentence always starts at '$', even without a line break. */
+                if(p->line_len > 0 && !p->discard)
+                {
+                    p->stats.malformed++;
+                }
+
+                p->line[0] = '$';
+                p->line_len = 1;
+                p->discard = false;
+            }
+            else if(p->line_len >= GPS_NMEA_LINE_MAX)
+            {
+                if(!p->discard)
+                {
+                    p->stats.malformed++;
+                }
+
+                p->discard = true;
+            }
+            else if(p->line_len > 0)
+            {
+                p->line[p->line_len++] = chunk[i];
+            }
+
+            /* One sentence can close two epochs, so keep room for both. */
+            if(client->ingest_len >= GPS_READ_BATCH - 1)
+            {
+                ret = gps_ingest_flush(client);
+
+                if(ret)
+                {
+                    return ret;
+                }
+            }
+        }
+    }
+
+    ret = gps_ingest_flush(client);
+
+    return ret ? ret : count;
+}
 
 /*****************************************
-*   Global variable Declarations.
+*   Debugfs.
 *****************************************/
-dev_t gps_dev_no;
-struct cdev gps_dev_cdev;
-struct class* gps_dev_class;
-struct file_operations gps_dev_f_ops = 
+static int gps_latency_hist_show(struct seq_file* m, void* v)
 {
-    .owner      = THIS_MODULE,
-    .read       = gps_dev_read,
-    .write      = gps_dev_write,
-    .open       = gps_dev_open,
-    .release    = gps_dev_close
-};
+    struct gps_device* gdev = m->private;
+    u64 total;
+    int cpu, b;
+
+    seq_puts(m, "# latency_ns_from latency_ns_to count\n");
+
+    for(b = 0; b < GPS_LAT_BUCKETS; b++)
+    {
+        total = 0;
+
+        for_each_possible_cpu(cpu)
+        {
+            total += per_cpu_ptr(gdev->lat_hist, cpu)->bucket[b];
+        }
+
+        if(total)
+        {
+            seq_printf(m, "%llu %llu %llu\n", 1ULL << b, (2ULL << b) - 1, total);
+        }
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gps_latency_hist);
 
 /*****************************************
 *   Function Definitions.
@@ -42,11 +2113,42 @@ static int __init gps_drv_init(void)
 {
     pr_info("Entered init function\n");
 
+    spin_lock_init(&gps_dev_state.lock);
+    init_waitqueue_head(&gps_dev_state.wait);
+    spin_lock_init(&gps_dev_state.fence_lock);
+    hash_init(gps_dev_state.fence_grid);
+    hash_init(gps_dev_state.fence_ids);
+    INIT_LIST_HEAD(&gps_dev_state.fence_inside);
+    init_waitqueue_head(&gps_dev_state.fence_wait);
+    mutex_init(&gps_dev_state.track_lock);
+    gps_dev_state.filter.cfg.accel_mmps2 = GPS_FILTER_ACCEL_MMPS2;
+    gps_dev_state.filter.cfg.sigma_mm = GPS_FILTER_SIGMA_MM;
+    gps_dev_state.filter.cfg.reset_gap_ms = GPS_FILTER_GAP_MS;
+    hrtimer_setup(&gps_dev_state.timer, gps_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+
+    gps_dev_state.lat_hist = alloc_percpu(struct gps_latency_hist);
+
+    if(NULL == gps_dev_state.lat_hist)
+    {
+        pr_info("Error in latency histogram allocation\n");
+
+        return -ENOMEM;
+    }
+
+    gps_dev_state.history = kvmalloc_array(GPS_HISTORY_LEN, sizeof(struct gps_fix_record), GFP_KERNEL);
+
+    if(NULL == gps_dev_state.history)
+    {
+        pr_info("Error in history allocation\n");
+
+        goto r_hist;
+    }
+
     if(alloc_chrdev_region(&gps_dev_no, 0, 1, DEVICE_NAME) < 0)
     {
         pr_info("Error in Device number creation\n");
 
-        return -1;
+        goto r_hist;
     }
 
     cdev_init(&gps_dev_cdev, &gps_dev_f_ops);
@@ -72,6 +2174,12 @@ static int __init gps_drv_init(void)
         goto r_device;
     }
 
+    gps_dev_state.debugfs_dir = debugfs_create_dir(GPS_DEBUGFS_DIR, NULL);
+    debugfs_create_file("latency_hist", 0444, gps_dev_state.debugfs_dir,
+                        &gps_dev_state, &gps_latency_hist_fops);
+
+    hrtimer_start(&gps_dev_state.timer, ms_to_ktime(GPS_FIX_INTERVAL_MS), HRTIMER_MODE_REL_SOFT);
+
     pr_info("GPS module inserted successfully\n");
 
     return 0;
@@ -85,6 +2193,10 @@ r_class:
 r_cdev:
     unregister_chrdev_region(gps_dev_no, 1);
 
+r_hist:
+    kvfree(gps_dev_state.history);
+    free_percpu(gps_dev_state.lat_hist);
+
     return -1;
 }
 
@@ -92,16 +2204,48 @@ static void __exit gps_drv_exit(void)
 {
     pr_info("Entered Exit Function\n");
 
+    hrtimer_cancel(&gps_dev_state.timer);
+    debugfs_remove_recursive(gps_dev_state.debugfs_dir);
+    kvfree(gps_dev_state.track);
+    gps_fence_clear(&gps_dev_state);
+
     device_destroy(gps_dev_class, gps_dev_no);
     class_destroy(gps_dev_class);
     cdev_del(&gps_dev_cdev);
     unregister_chrdev_region(gps_dev_no, 1);
+    kvfree(gps_dev_state.history);
+    free_percpu(gps_dev_state.lat_hist);
 
     pr_info("Module Removed successfully\n");
 }
 
 static int gps_dev_open(struct inode* inode, struct file* file)
 {
+    struct gps_client* client;
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+
+    if(NULL == client)
+    {
+        return -ENOMEM;
+    }
+
+    client->gdev = &gps_dev_state;
+    mutex_init(&client->read_lock);
+    mutex_init(&client->write_lock);
+    client->write_mode = GPS_WRITE_TRACK;
+    client->format = GPS_FORMAT_NMEA;
+
+    /* Start from the latest fix so the first read has data. */
+    client->next_seq = smp_load_acquire(&gps_dev_state.head);
+
+    if(client->next_seq > 0)
+    {
+        client->next_seq--;
+    }
+
+    file->private_data = client;
+
     pr_info("GPS device opened\n");
 
     return 0;
@@ -109,25 +2253,455 @@ static int gps_dev_open(struct inode* inode, struct file* file)
 
 static int gps_dev_close(struct inode* inode, struct file* file)
 {
+    struct gps_client* client = file->private_data;
+
+    /*
+    * Deliver the last epoch of an NMEA stream. Nobody is left to see an
+    * error here, a failed flush shows up in the dropped ingest stat.
+    */
+    gps_nmea_emit(client);
+    gps_ingest_flush(client);
+
+    kfree(client);
+
     pr_info("GPS device closed\n");
 
     return 0;
 }
 
+/*
+* Feed fixes into the device: NMEA text is parsed in the kernel, binary
+* writes carry struct gps_fix_record. Depending on the write mode the
+* fixes are published to readers right away or appended to the replay
+* track.
+*/
 static ssize_t gps_dev_write(struct file* filep,
      const char __user* buffer, size_t count, loff_t* lofft)
 {
-    pr_info("GPS device write called\n");
+    struct gps_client* client = filep->private_data;
+    ssize_t ret;
 
-    return 0;
+    if(0 == count)
+    {
+        return 0;
+    }
+
+    if(mutex_lock_interruptible(&client->write_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    if(GPS_FORMAT_BINARY == client->format)
+    {
+        ret = gps_write_binary(client, buffer, count);
+    }
+    else if(GPS_FORMAT_NMEA == client->format)
+    {
+        ret = gps_write_nmea(client, buffer, count);
+    }
+    else
+    {
+        ret = -EOPNOTSUPP;
+    }
+
+    mutex_unlock(&client->write_lock);
+
+    return ret;
+}
+
+static ssize_t gps_read_binary(struct gps_client* client,
+     char __user* buffer, size_t count)
+{
+    struct gps_fix_record fixes[GPS_READ_BATCH];
+    size_t wanted = count / sizeof(struct gps_fix_record);
+    ssize_t copied = 0;
+    int n;
+
+    if(0 == wanted)
+    {
+        return -EINVAL;
+    }
+
+    while(wanted > 0)
+    {
+        n = gps_fetch_fixes(client, fixes, min_t(size_t, wanted, GPS_READ_BATCH));
+
+        if(0 == n)
+        {
+            break;
+        }
+
+        if(copy_to_user(buffer + copied, fixes, n * sizeof(struct gps_fix_record)))
+        {
+            return copied ? copied : -EFAULT;
+        }
+
+        copied += n * sizeof(struct gps_fix_record);
+        wanted -= n;
+    }
+
+    return copied;
+}
+
+static ssize_t gps_read_events(struct gps_client* client,
+     char __user* buffer, size_t count)
+{
+    struct gps_fence_event events[GPS_READ_BATCH];
+    size_t wanted = count / sizeof(struct gps_fence_event);
+    ssize_t copied = 0;
+    int n;
+
+    if(0 == wanted)
+    {
+        return -EINVAL;
+    }
+
+    while(wanted > 0)
+    {
+        n = gps_fetch_events(client, events, min_t(size_t, wanted, GPS_READ_BATCH));
+
+        if(0 == n)
+        {
+            break;
+        }
+
+        if(copy_to_user(buffer + copied, events, n * sizeof(struct gps_fence_event)))
+        {
+            return copied ? copied : -EFAULT;
+        }
+
+        copied += n * sizeof(struct gps_fence_event);
+        wanted -= n;
+    }
+
+    return copied;
+}
+
+static ssize_t gps_read_nmea(struct gps_client* client,
+     char __user* buffer, size_t count)
+{
+    struct gps_fix_record fix;
+    ssize_t copied = 0;
+    size_t chunk;
+
+    while(copied < count)
+    {
+        /* Finish any sentence text left over from the previous read first. */
+        if(client->nmea_off >= client->nmea_len)
+        {
+            if(0 == gps_fetch_fixes(client, &fix, 1))
+            {
+                break;
+            }
+
+            client->nmea_len = gps_nmea_format(&fix, client->nmea, sizeof(client->nmea));
+            client->nmea_off = 0;
+        }
+
+        chunk = min_t(size_t, count - copied, client->nmea_len - client->nmea_off);
+
+        if(copy_to_user(buffer + copied, client->nmea + client->nmea_off, chunk))
+        {
+            return copied ? copied : -EFAULT;
+        }
+
+        client->nmea_off += chunk;
+        copied += chunk;
+    }
+
+    return copied;
 }
 
 static ssize_t gps_dev_read(struct file* filep,
      char __user* buffer, size_t count, loff_t* lofft)
 {
-    pr_info("GPS device read called\n");
+    struct gps_client* client = filep->private_data;
+    ssize_t ret;
 
-    return 0;
+    if(mutex_lock_interruptible(&client->read_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    if(!gps_client_ready(client))
+    {
+        if(filep->f_flags & O_NONBLOCK)
+        {
+            mutex_unlock(&client->read_lock);
+
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(*gps_client_wq(client), gps_client_ready(client)))
+        {
+            mutex_unlock(&client->read_lock);
+
+            return -ERESTARTSYS;
+        }
+    }
+
+    if(GPS_FORMAT_BINARY == client->format)
+    {
+        ret = gps_read_binary(client, buffer, count);
+    }
+    else if(GPS_FORMAT_FENCE_EVENTS == client->format)
+    {
+        ret = gps_read_events(client, buffer, count);
+    }
+    else
+    {
+        ret = gps_read_nmea(client, buffer, count);
+    }
+
+    mutex_unlock(&client->read_lock);
+
+    return ret;
+}
+
+static __poll_t gps_dev_poll(struct file* file, poll_table* wait)
+{
+    struct gps_client* client = file->private_data;
+
+    poll_wait(file, gps_client_wq(client), wait);
+
+    return gps_client_ready(client) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+static long gps_dev_ioctl(struct file* file, unsigned int cmd, unsigned long args)
+{
+    struct gps_client* client = file->private_data;
+    struct gps_device* gdev = client->gdev;
+    struct gps_replay_cfg cfg;
+    struct gps_replay_status status;
+    struct gps_range_query query;
+    struct gps_filter_cfg filter_cfg;
+    struct gps_ingest_stats ingest_stats;
+    struct gps_fence_def* fence_def;
+    u32 fence_id;
+    int mode;
+    int ret = 0;
+    int format;
+
+    switch(cmd)
+    {
+        case GPS_SET_FORMAT:
+            if(copy_from_user(&format, (int __user*)args, sizeof(int)))
+            {
+                return -EFAULT;
+            }
+
+            if(format != GPS_FORMAT_NMEA && format != GPS_FORMAT_BINARY &&
+               format != GPS_FORMAT_FENCE_EVENTS)
+            {
+                return -EINVAL;
+            }
+
+            /* Drop any half-read sentence so the new format starts on a record boundary. */
+            mutex_lock(&client->read_lock);
+
+            if(GPS_FORMAT_FENCE_EVENTS == format && client->format != format)
+            {
+                client->next_event = smp_load_acquire(&gdev->event_head);
+            }
+
+            client->format = format;
+            client->nmea_len = 0;
+            client->nmea_off = 0;
+            mutex_unlock(&client->read_lock);
+
+            break;
+
+        case GPS_GET_FORMAT:
+            if(copy_to_user((int __user*)args, &client->format, sizeof(int)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case GPS_SET_FILTER:
+            if(copy_from_user(&filter_cfg, (struct gps_filter_cfg __user*)args, sizeof(filter_cfg)))
+            {
+                return -EFAULT;
+            }
+
+            ret = gps_filter_configure(gdev, &filter_cfg);
+
+            break;
+
+        case GPS_GET_FILTER:
+            spin_lock_bh(&gdev->lock);
+            filter_cfg = gdev->filter.cfg;
+            spin_unlock_bh(&gdev->lock);
+
+            if(copy_to_user((struct gps_filter_cfg __user*)args, &filter_cfg, sizeof(filter_cfg)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case GPS_GET_LOST:
+            if(copy_to_user((__u64 __user*)args, &client->lost, sizeof(__u64)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case GPS_HISTORY_QUERY:
+            if(copy_from_user(&query, (struct gps_range_query __user*)args, sizeof(query)))
+            {
+                return -EFAULT;
+            }
+
+            if(query.t_start_ns > query.t_end_ns)
+            {
+                return -EINVAL;
+            }
+
+            ret = gps_history_query(gdev, &query);
+
+            if(0 == ret && copy_to_user((struct gps_range_query __user*)args, &query, sizeof(query)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case GPS_SET_WRITE_MODE:
+            if(copy_from_user(&mode, (int __user*)args, sizeof(int)))
+            {
+                return -EFAULT;
+            }
+
+            if(mode != GPS_WRITE_TRACK && mode != GPS_WRITE_LIVE)
+            {
+                return -EINVAL;
+            }
+
+            mutex_lock(&client->write_lock);
+            client->write_mode = mode;
+            mutex_unlock(&client->write_lock);
+
+            break;
+
+        case GPS_GET_INGEST_STATS:
+            ingest_stats = client->parser.stats;
+
+            mutex_lock(&gdev->track_lock);
+            ingest_stats.dropped = gdev->ingest_dropped;
+            mutex_unlock(&gdev->track_lock);
+
+            if(copy_to_user((struct gps_ingest_stats __user*)args, &ingest_stats,
+                            sizeof(struct gps_ingest_stats)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case GPS_FENCE_ADD:
+            fence_def = memdup_user((struct gps_fence_def __user*)args, sizeof(*fence_def));
+
+            if(IS_ERR(fence_def))
+            {
+                return PTR_ERR(fence_def);
+            }
+
+            ret = gps_fence_add(gdev, fence_def);
+            kfree(fence_def);
+
+            break;
+
+        case GPS_FENCE_DEL:
+            if(copy_from_user(&fence_id, (__u32 __user*)args, sizeof(fence_id)))
+            {
+                return -EFAULT;
+            }
+
+            ret = gps_fence_del(gdev, fence_id);
+
+            break;
+
+        case GPS_FENCE_CLEAR:
+            gps_fence_clear(gdev);
+
+            break;
+
+        case GPS_TRACK_CLEAR:
+            mutex_lock(&gdev->track_lock);
+
+            if(gdev->replay_running)
+            {
+                ret = -EBUSY;
+            }
+            else
+            {
+                gdev->track_len = 0;
+            }
+
+            mutex_unlock(&gdev->track_lock);
+
+            break;
+
+        case GPS_TRACK_START:
+            if(copy_from_user(&cfg, (struct gps_replay_cfg __user*)args, sizeof(cfg)))
+            {
+                return -EFAULT;
+            }
+
+            if(cfg.rate < 1 || cfg.rate > GPS_REPLAY_MAX_RATE || (cfg.flags & ~GPS_REPLAY_LOOP))
+            {
+                return -EINVAL;
+            }
+
+            mutex_lock(&gdev->track_lock);
+
+            if(0 == gdev->track_len)
+            {
+                ret = -ENODATA;
+            }
+            else
+            {
+                gps_replay_start(gdev, cfg.rate, cfg.flags);
+            }
+
+            mutex_unlock(&gdev->track_lock);
+
+            break;
+
+        case GPS_TRACK_STOP:
+            mutex_lock(&gdev->track_lock);
+            gps_replay_stop(gdev);
+            mutex_unlock(&gdev->track_lock);
+
+            break;
+
+        case GPS_TRACK_STATUS:
+            memset(&status, 0, sizeof(status));
+
+            mutex_lock(&gdev->track_lock);
+            status.track_len = gdev->track_len;
+            status.position = READ_ONCE(gdev->replay_pos);
+            status.rate = gdev->replay_rate;
+            status.running = READ_ONCE(gdev->replay_running);
+            mutex_unlock(&gdev->track_lock);
+
+            if(copy_to_user((struct gps_replay_status __user*)args, &status, sizeof(status)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        default:
+            pr_info("Unknown ioctl command: %u\n", cmd);
+
+            return -ENOTTY;
+    }
+
+    return ret;
 }
 
 /*****************************************
@@ -10,9 +10,35 @@
 #include <linux/uaccess.h>
 #include <linux/ioctl.h>
 #include <linux/slab.h>
-#include <linux/semaphore.h>
-#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/interval_tree.h>
 #include <linux/string.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/bitops.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/seqlock.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/scatterlist.h>
+#include <crypto/hash.h>
+#include <crypto/acompress.h>
 
 /**********************************************************************************
 * Macro Defintions.
@@ -20,24 +46,113 @@
 #define DEVICE_NUMBER                       ("Block_device_no")
 #define DEVICE_NAME                         ("Block_device")
 #define DEVICE_CLASS                        ("Block_class")
-#define REGION_SIZE                         (512)
-#define TOTAL_REGIONS                       (8)
-#define TOTAL_SIZE                          (REGION_SIZE * TOTAL_REGIONS)
+#define BLK_DEVICE_NAME                     ("vblock")
+#define BLK_QUEUE_DEPTH                     (128)
+#define BLK_MAX_SECTORS                     (256)
+#define REGION_DATA_SIZE                    (512)
+#define DEFAULT_REGION_SIZE                 (512)
+#define DEFAULT_TOTAL_REGIONS               (8)
+#define MAX_LOCK_STRIPES                    (1024)
+#define VBLOCK_MAX_SNAPSHOTS                (16)
+#define VBLOCK_MAX_REPLICAS                 (4)
+#define DEFAULT_MIRROR_MAX_LAG              (1024)
+#define VBLOCK_SCRUB_TICK_MS                (100)
+#define VBLOCK_LOAD_CHUNK                   (8 << 20)
+#define VBLOCK_WB_BUF_SIZE                  (256 << 10)
+#define DEFAULT_WRITEBACK_INTERVAL_MS       (1000)
+#define DEFAULT_FSYNC_INTERVAL_MS           (5000)
+#define DEFAULT_COMPRESS_INTERVAL_MS        (1000)
+#define VBLOCK_ZCACHE_SLOTS                 (8)
+#define VBLOCK_LAT_BUCKETS                  (40)
+#define VBLOCK_STAT_MAX_BUCKETS             (4096)
+#define VBLOCK_STAT_MAX_BYTES               (64 << 20)
 
 #define VBLOCK_LOCK_REGION                  _IOW('a', 1, int)
 #define VBLOCK_UNLOCK_REGION                _IOW('a', 2, int)
 #define VBLOCK_READ_REGION                  _IOWR('a', 3, struct region_data)
 #define VBLOCK_GET_INFO                     _IOR('a', 4, struct device_info)
 #define VBLOCK_ERASE_REGION                 _IOW('a', 5, int)
+#define VBLOCK_SET_MODE                     _IOW('a', 6, int)
+#define VBLOCK_FD_UNLOCK                    _IOW('a', 7, struct region_key)
+#define VBLOCK_SUBMIT_BATCH                 _IOWR('a', 8, struct vblock_batch)
+#define VBLOCK_SNAPSHOT                     _IOR('a', 9, int)
+#define VBLOCK_SNAPSHOT_DELETE              _IOW('a', 10, int)
+#define VBLOCK_DISCARD                      _IOW('a', 11, struct vblock_extent)
+#define VBLOCK_WRITE_ZEROES                 _IOW('a', 12, struct vblock_extent)
+#define VBLOCK_AUTH_REGIONS                 _IOW('a', 13, struct vblock_auth)
+#define VBLOCK_GET_INFO_V2                  _IOWR('a', 14, struct vblock_info_v2)
+
+#define VBLOCK_MODE_ASCII                   0
+#define VBLOCK_MODE_BINARY                  1
+
+#define VBLOCK_OP_READ                      0
+#define VBLOCK_OP_WRITE                     1
+#define VBLOCK_OP_ERASE                     2
+#define VBLOCK_BATCH_MAX                    4096
 
 #define MAX_KEYS                            10
+#define VBLOCK_KEY_HASH_BITS                4
+
+#define VBLOCK_STAT_READS                   0
+#define VBLOCK_STAT_WRITES                  1
+#define VBLOCK_STAT_READ_BYTES              2
+#define VBLOCK_STAT_WRITE_BYTES             3
+#define VBLOCK_STAT_LOCK_WAIT_NS            4
+#define VBLOCK_STAT_NR                      5
+
+#define VBLOCK_LAT_READ                     0
+#define VBLOCK_LAT_WRITE                    1
+#define VBLOCK_LAT_IOCTL                    2
+#define VBLOCK_LAT_NR                       3
 
 /**********************************************************************************
 * Data Structures.
 **********************************************************************************/
+// VBLOCK_READ_REGION is only available while region_size is REGION_DATA_SIZE
 struct region_data {
     int region_num;
-    char data[REGION_SIZE];
+    char data[REGION_DATA_SIZE];
+};
+
+struct region_key {
+    int region_num;
+    int key;
+};
+
+/*
+ * One VBLOCK_SUBMIT_BATCH entry, a span inside one region. status is set
+ * to 0 or a negative errno for every entry.
+ */
+struct vblock_io {
+    __u32 op;
+    __u32 region_num;
+    __u32 offset;
+    __u32 len;
+    __u64 buf;
+    __s32 status;
+    __u32 reserved;
+};
+
+struct vblock_batch {
+    __u64 entries;
+    __u32 count;
+    __u32 reserved;
+};
+
+/*
+ * VBLOCK_AUTH_REGIONS: entries points to count struct region_key. Either
+ * every region is unlocked for the file or, on error, none of them.
+ */
+struct vblock_auth {
+    __u64 entries;
+    __u32 count;
+    __u32 reserved;
+};
+
+// A byte range for VBLOCK_DISCARD and VBLOCK_WRITE_ZEROES
+struct vblock_extent {
+    __u64 offset;
+    __u64 len;
 };
 
 struct device_info {
@@ -49,24 +164,217 @@ struct device_info {
     int key_count;
 };
 
-struct vblock_region {
-    char data[REGION_SIZE];
-    int locked;
-    int lock_key;
-    struct mutex region_mutex;
-    struct semaphore read_sem;
+/*
+ * VBLOCK_GET_INFO_V2. The caller passes two arrays of bitmap_words u64s,
+ * either may be 0; bit n of the array is region n. bitmap_words is set to
+ * the number of words needed, only as many as fit are copied. The lock
+ * bitmap, nr_locked and lock_seq are a consistent snapshot, lock_seq
+ * changes whenever a region is locked or unlocked. The dirty bitmap
+ * (written since the last backup) changes under concurrent writes and is
+ * only as exact as each word.
+ */
+struct vblock_info_v2 {
+    __u64 lock_bitmap;
+    __u64 dirty_bitmap;
+    __u32 bitmap_words;
+    __u32 total_regions;
+    __u32 region_size;
+    __u32 key_count;
+    __u32 nr_replicas;
+    __u32 mirror_pending;
+    __u32 nr_locked;
+    __u32 nr_dirty;
+    __u32 snap_gen;
+    __u32 reserved;
+    __u64 lock_seq;
+};
+
+// A valid user key, hashed into vblock_device.keys
+struct vblock_key {
+    struct hlist_node node;
+    int key;
+};
+
+/*
+ * A point-in-time view of the device. Nothing is copied when it is taken:
+ * the first write to a region after the newest snapshot saves the old
+ * contents into it. Snapshot n is the read-only minor n + 1.
+ */
+struct vblock_snapshot {
+    struct list_head list;              // in dev->snapshots, oldest first
+    unsigned int slot;
+    u32 gen;
+    struct xarray regions;              // region copies taken before a write
+    struct device *device;
+    bool deleted;
+    struct kref ref;                    // held by open files
+};
+
+/*
+ * A mirror copy of the device, in memory or in a file. A replica whose
+ * update failed is out of sync for good and no longer used.
+ */
+struct vblock_replica {
+    struct xarray pages;                // in-memory replica
+    struct file *file;                  // file replica, NULL for memory
+    bool in_sync;
+};
+
+/*
+ * A compressed page. gen is unique to each compression and keys the
+ * decompression caches, so a cached copy never outlives its source.
+ */
+struct vblock_zpage {
+    u64 gen;
+    unsigned int len;
+    u8 data[];
+};
+
+/*
+ * Per CPU compression context with a small LRU cache of decompressed pages.
+ * Everything in it is used under lock, a task that migrates keeps working
+ * on the one it locked.
+ */
+struct vblock_zcache {
+    struct mutex lock;
+    struct acomp_req *req;
+    void *buf;                          // compressor output, two pages
+    unsigned long tick;
+    u64 gen[VBLOCK_ZCACHE_SLOTS];       // 0 for an empty slot
+    unsigned long used[VBLOCK_ZCACHE_SLOTS];
+    void *data[VBLOCK_ZCACHE_SLOTS];
+};
+
+/*
+ * One CPU's statistics: per region counters indexed by VBLOCK_STAT_*, and
+ * log2 latency histograms of the read, write and ioctl paths in ns. Past
+ * VBLOCK_STAT_MAX_BUCKETS regions, neighbouring regions share a counter.
+ */
+struct vblock_stats {
+    u64 (*regions)[VBLOCK_STAT_NR];
+    u64 lat[VBLOCK_LAT_NR][VBLOCK_LAT_BUCKETS];
+};
+
+/*
+ * A held or awaited byte-range lock. blocking counts the earlier conflicting
+ * ranges still in the tree, the owner runs once it drops to zero.
+ */
+struct vblock_range {
+    struct interval_tree_node node;
+    u64 seq;
+    bool exclusive;
+    unsigned int blocking;
+    struct task_struct *task;
 };
 
+/*
+ * Storage is sparse: data pages live in an xarray indexed by page and are
+ * allocated on first write, lock state is one bit per region. Regions
+ * never straddle a page since region_size is a power of two <= PAGE_SIZE.
+ * Data is guarded by byte-range locks in the ranges interval tree: reads
+ * share their span, writes hold theirs exclusively, so disjoint writes run
+ * in parallel even inside one region. Whole-region work such as lock
+ * changes, erases, mirroring and scrubbing locks the region's whole span.
+ * Per-region metadata that disjoint writers share, the snapshot copy and
+ * the checksum, is updated under a striped mutex, meta_locks[n & lock_mask].
+ * Writes set the region's bit in dirty, backups clear it.
+ * Writers also hold snap_sem for read, taking a snapshot holds it for write.
+ * Page faults on our mappings take snap_sem and range locks under mmap_lock,
+ * so mmap_lock comes first: user memory is never faulted in with a range
+ * lock or snap_sem held. Copies to and from user space under them do not
+ * fault; on -EFAULT the caller drops its locks, faults the buffer in and
+ * retries.
+ * cow_gen[n] is the snapshot generation region n was last written in.
+ * Written regions are logged for the mirror thread, which updates the
+ * replicas; writers wait while more than mirror_max_lag regions are behind.
+ * csums[n] is the crc32c of region n as last written, a region written
+ * through a mapping is csum_stale until the scrubber or mirror re-reads it.
+ * With compression on, a page untouched for a whole interval moves from
+ * pages to zpages. Reads decompress it into a per CPU cache, writes put it
+ * back in pages first; zlocks[index & lock_mask] serializes both against
+ * the compressor.
+ */
 struct vblock_device {
-    struct vblock_region regions[TOTAL_REGIONS];
-    char *mirror_buffer;
-    int mirror_enable;
+    struct xarray pages;
+    unsigned long *locked;              // regions locked by VBLOCK_LOCK_REGION
+    seqlock_t lock_seq;                 // serializes changes to locked, readers retry
+    struct rb_root_cached ranges;
+    spinlock_t ranges_lock;
+    u64 range_seq;
+    struct mutex *meta_locks;
+    unsigned int lock_mask;
+    unsigned int region_size;
+    unsigned int total_regions;
+    u64 size;
+    struct vblock_replica replicas[VBLOCK_MAX_REPLICAS];   // in-memory ones first
+    unsigned int nr_replicas;
+    unsigned int nr_mem_replicas;
+    DECLARE_KFIFO_PTR(mirror_log, u32);
+    spinlock_t mirror_log_lock;         // serializes writers, the thread reads alone
+    unsigned long *mirror_queued;       // regions logged and not copied yet
+    bool mirror_overflow;               // a region did not fit in the log
+    atomic_t mirror_pending;
+    unsigned int mirror_max_lag;
+    wait_queue_head_t mirror_kick;
+    wait_queue_head_t mirror_wait;
+    struct task_struct *mirror_thread;
+    char *mirror_buf;
+    struct crypto_shash *csum_tfm;
+    u32 *csums;
+    u32 zero_csum;
+    unsigned long *csum_stale;
+    unsigned long *scrub_suspect;       // failed a read check, scrubbed first
+    struct task_struct *scrub_thread;
+    char *scrub_buf;
+    struct file *image;                 // backing image, NULL if none
+    unsigned long *wb_dirty;            // regions not yet written back to the image
+    struct task_struct *wb_thread;
+    char *wb_buf;
+    struct crypto_acomp *ztfm;          // NULL unless compression is on
+    struct vblock_zcache __percpu *zcache;
+    struct xarray zpages;
+    struct mutex *zlocks;               // taken after meta_locks
+    atomic64_t zgen;
+    struct task_struct *zthread;
+    struct vblock_stats __percpu *stats;    // NULL unless stats_enable
+    unsigned int stats_shift;           // log2 of the regions sharing a counter
+    unsigned int stats_buckets;
+    struct dentry *debugfs_dir;
+    unsigned long *dirty;               // regions written since the last backup
+    struct mutex backup_mutex;
+    char *backup_file;                  // target of the last complete backup
+    struct delayed_work backup_work;
+    struct percpu_rw_semaphore snap_sem;
+    struct list_head snapshots;
+    struct vblock_snapshot *snaps[VBLOCK_MAX_SNAPSHOTS];
+    struct mutex snap_mutex;            // serializes snapshot create, delete and open
+    u32 snap_gen;
+    u32 *cow_gen;
     int user_keys[MAX_KEYS];
     int key_count;
+    struct vblock_key key_nodes[MAX_KEYS];
+    DECLARE_HASHTABLE(keys, VBLOCK_KEY_HASH_BITS);
     dev_t dev_no;
     struct cdev cdev;
     struct class *class;
     struct device *device;
+    int blk_major;
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *disk;
+    struct inode *inode;                // owner of the address space shared by all files
+};
+
+/*
+ * Per open file state. In binary mode write() copies the payload as is to
+ * *lofft; locked regions are written only if this file unlocked them with
+ * VBLOCK_FD_UNLOCK or VBLOCK_AUTH_REGIONS. ASCII writes to such regions
+ * need no key either. The unlocked bitmap is allocated on first use.
+ */
+struct vblock_file {
+    struct vblock_device *dev;
+    struct vblock_snapshot *snap;       // set on a snapshot minor
+    int mode;
+    unsigned long *unlocked;
 };
 
 /**********************************************************************************
@@ -82,9 +390,22 @@ static ssize_t block_dev_write(struct file* filep, const char __user* buffer,
      size_t count, loff_t* lofft);
 static long block_dev_ioctl(struct file* file,
      unsigned int cmd, unsigned long args);
+static loff_t block_dev_llseek(struct file* file, loff_t offset, int whence);
+static int block_dev_mmap(struct file* file, struct vm_area_struct* vma);
 static int parse_write_data(const char *buffer, size_t count, 
                            loff_t *offset, int *key);
 static bool is_valid_key(struct vblock_device *dev, int key);
+static int check_region_key(struct vblock_device *dev,
+                            unsigned int region_num, int key_status, int key);
+static int vblock_rw_kernel(struct vblock_device *dev, void *buf,
+                            loff_t pos, size_t len, bool is_write);
+static blk_status_t vblock_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                    const struct blk_mq_queue_data *bd);
+static int vblock_blk_init(struct vblock_device *dev);
+static int vblock_scrub_rate_set(const char *val, const struct kernel_param *kp);
+static void vblock_blk_exit(struct vblock_device *dev);
+static void vblock_backup_work(struct work_struct *work);
+static void vblock_zap_page(struct vblock_device *dev, pgoff_t index);
 
 /**********************************************************************************
 * Module Parameters.
@@ -96,7 +417,69 @@ MODULE_PARM_DESC(user_keys, "Array of valid integer keys for unlocking writes");
 
 static int mirror_enable = 0;
 module_param(mirror_enable, int, 0644);
-MODULE_PARM_DESC(mirror_enable, "Enable mirroring of writes (0=disabled, 1=enabled)");
+MODULE_PARM_DESC(mirror_enable, "Number of in-memory mirror replicas (0=disabled)");
+
+static char *mirror_files[VBLOCK_MAX_REPLICAS];
+static int mirror_file_count = 0;
+module_param_array(mirror_files, charp, &mirror_file_count, 0444);
+MODULE_PARM_DESC(mirror_files, "Files to keep mirror replicas in");
+
+static unsigned int mirror_max_lag = DEFAULT_MIRROR_MAX_LAG;
+module_param(mirror_max_lag, uint, 0444);
+MODULE_PARM_DESC(mirror_max_lag, "Regions the mirror may fall behind before writers wait");
+
+static bool verify_reads = false;
+module_param(verify_reads, bool, 0644);
+MODULE_PARM_DESC(verify_reads, "Check region checksums on every read");
+
+static unsigned int scrub_rate = 0;
+static DECLARE_WAIT_QUEUE_HEAD(scrub_rate_wait);
+static const struct kernel_param_ops scrub_rate_ops = {
+    .set = vblock_scrub_rate_set,
+    .get = param_get_uint,
+};
+module_param_cb(scrub_rate, &scrub_rate_ops, &scrub_rate, 0644);
+MODULE_PARM_DESC(scrub_rate, "Regions checked per second by the background scrubber (0=disabled)");
+
+static char *image_path;
+module_param(image_path, charp, 0444);
+MODULE_PARM_DESC(image_path, "Backing image, loaded at init and kept up to date by write-back");
+
+static unsigned int writeback_interval_ms = DEFAULT_WRITEBACK_INTERVAL_MS;
+module_param(writeback_interval_ms, uint, 0444);
+MODULE_PARM_DESC(writeback_interval_ms, "Period of dirty region write-back to the image");
+
+static unsigned int fsync_interval_ms = DEFAULT_FSYNC_INTERVAL_MS;
+module_param(fsync_interval_ms, uint, 0444);
+MODULE_PARM_DESC(fsync_interval_ms, "Minimum time between fsyncs of the image");
+
+static unsigned int region_size = DEFAULT_REGION_SIZE;
+module_param(region_size, uint, 0444);
+MODULE_PARM_DESC(region_size, "Region size in bytes, a power of two from 512 to PAGE_SIZE");
+
+static unsigned int total_regions = DEFAULT_TOTAL_REGIONS;
+module_param(total_regions, uint, 0444);
+MODULE_PARM_DESC(total_regions, "Number of regions, memory is only used for written regions");
+
+static char *compress;
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "Compress cold pages with this algorithm, e.g. lz4 or zstd (unset=disabled)");
+
+static unsigned int compress_interval_ms = DEFAULT_COMPRESS_INTERVAL_MS;
+module_param(compress_interval_ms, uint, 0444);
+MODULE_PARM_DESC(compress_interval_ms, "Pages untouched for this long are compressed");
+
+static bool stats_enable = false;
+module_param(stats_enable, bool, 0444);
+MODULE_PARM_DESC(stats_enable, "Collect per-region and latency statistics in debugfs");
+
+static char *backup_path;
+module_param(backup_path, charp, 0444);
+MODULE_PARM_DESC(backup_path, "File backed up to periodically and on unload");
+
+static unsigned int backup_interval_ms = 0;
+module_param(backup_interval_ms, uint, 0444);
+MODULE_PARM_DESC(backup_interval_ms, "Period of incremental backups to backup_path (0=only on unload)");
 
 /**********************************************************************************
 * Global data declaration and Initializations.
@@ -110,126 +493,3091 @@ struct file_operations block_dev_f_ops =
     .release        = block_dev_release,
     .read           = block_dev_read,
     .write          = block_dev_write,
+    .llseek         = block_dev_llseek,
     .unlocked_ioctl = block_dev_ioctl,
+    .mmap           = block_dev_mmap,
+};
+
+static const struct blk_mq_ops vblock_mq_ops = {
+    .queue_rq       = vblock_queue_rq,
+};
+
+static const struct block_device_operations vblock_bd_ops = {
+    .owner          = THIS_MODULE,
 };
 
 /**********************************************************************************
-* Exported Backup Function.
+* Storage Helpers.
 **********************************************************************************/
-int vblock_backup_to_file(const char *path)
+static inline struct mutex *region_meta_lock(struct vblock_device *dev,
+                                             unsigned int region_num)
 {
-    struct file *file;
-    loff_t pos = 0;
-    char *buffer;
-    int i, ret = 0;
+    return &dev->meta_locks[region_num & dev->lock_mask];
+}
+
+static inline bool region_valid(struct vblock_device *dev, int region_num)
+{
+    return region_num >= 0 && region_num < dev->total_regions;
+}
+
+// Use a simple key generation (region number + 1000)
+static inline int region_lock_key(int region_num)
+{
+    return region_num + 1000;
+}
+
+// Stable while the caller holds any range lock on part of the region
+static inline bool region_locked(struct vblock_device *dev, unsigned int region_num)
+{
+    return test_bit(region_num, dev->locked);
+}
+
+static inline u64 region_pos(struct vblock_device *dev, unsigned int region_num)
+{
+    return (u64)region_num * dev->region_size;
+}
+
+// Pending for both the next backup and the image write-back
+static inline void vblock_mark_dirty(struct vblock_device *dev, unsigned int region_num)
+{
+    set_bit(region_num, dev->dirty);
+    if (dev->wb_dirty)
+        set_bit(region_num, dev->wb_dirty);
+}
+
+// Regions in page index, the first one is returned in *first
+static inline unsigned int page_regions(struct vblock_device *dev, pgoff_t index,
+                                        unsigned int *first)
+{
+    *first = ((u64)index << PAGE_SHIFT) / dev->region_size;
+    return min_t(unsigned int, PAGE_SIZE / dev->region_size, dev->total_regions - *first);
+}
+
+/**********************************************************************************
+* Statistics.
+**********************************************************************************/
+static inline u64 vblock_stat_start(struct vblock_device *dev)
+{
+    return dev->stats ? ktime_get_ns() : 0;
+}
+
+static void vblock_stat_latency(struct vblock_device *dev, int op, u64 start)
+{
+    u64 ns;
+    unsigned int b;
     
-    if (!vblock_dev) {
-        pr_err("Device not initialized\n");
-        return -ENODEV;
+    if (!dev->stats)
+        return;
+    
+    ns = ktime_get_ns() - start;
+    b = ns ? min_t(unsigned int, ilog2(ns), VBLOCK_LAT_BUCKETS - 1) : 0;
+    this_cpu_inc(dev->stats->lat[op][b]);
+}
+
+// Counters are only ever touched by their own CPU, with preemption off
+static void vblock_stat_add(struct vblock_device *dev, unsigned int region_num,
+                            int stat, u64 val)
+{
+    struct vblock_stats *st;
+    
+    if (!dev->stats)
+        return;
+    
+    st = get_cpu_ptr(dev->stats);
+    st->regions[region_num >> dev->stats_shift][stat] += val;
+    put_cpu_ptr(dev->stats);
+}
+
+static inline void vblock_stat_io(struct vblock_device *dev, unsigned int region_num,
+                                  bool write, size_t bytes)
+{
+    vblock_stat_add(dev, region_num, write ? VBLOCK_STAT_WRITES : VBLOCK_STAT_READS, 1);
+    vblock_stat_add(dev, region_num, write ? VBLOCK_STAT_WRITE_BYTES : VBLOCK_STAT_READ_BYTES,
+                    bytes);
+}
+
+static void *vblock_region_stats_start(struct seq_file *m, loff_t *pos)
+{
+    struct vblock_device *dev = m->private;
+    
+    return *pos < dev->stats_buckets ? pos : NULL;
+}
+
+static void *vblock_region_stats_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    (*pos)++;
+    return vblock_region_stats_start(m, pos);
+}
+
+static void vblock_region_stats_stop(struct seq_file *m, void *v)
+{
+}
+
+/*
+ * One line per counter that saw any I/O, summed over all CPUs. A line
+ * covers regions_per_line regions starting at the one it names.
+ */
+static int vblock_region_stats_show(struct seq_file *m, void *v)
+{
+    struct vblock_device *dev = m->private;
+    unsigned int bucket = *(loff_t *)v;
+    u64 sum[VBLOCK_STAT_NR] = { 0 };
+    int cpu, i;
+    
+    if (bucket == 0) {
+        seq_printf(m, "# regions_per_line %u\n", 1U << dev->stats_shift);
+        seq_puts(m, "# region reads writes read_bytes write_bytes lock_wait_ns\n");
     }
     
-    buffer = kmalloc(TOTAL_SIZE, GFP_KERNEL);
-    if (!buffer) {
-        pr_err("Failed to allocate backup buffer\n");
-        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        for (i = 0; i < VBLOCK_STAT_NR; i++)
+            sum[i] += READ_ONCE(per_cpu_ptr(dev->stats, cpu)->regions[bucket][i]);
     }
     
-    // Copy data from all regions
-    for (i = 0; i < TOTAL_REGIONS; i++) {
-        if (down_interruptible(&vblock_dev->regions[i].read_sem)) {
-            kfree(buffer);
-            return -ERESTARTSYS;
+    if (sum[VBLOCK_STAT_READS] || sum[VBLOCK_STAT_WRITES] || sum[VBLOCK_STAT_LOCK_WAIT_NS])
+        seq_printf(m, "%u %llu %llu %llu %llu %llu\n", bucket << dev->stats_shift,
+                   sum[VBLOCK_STAT_READS], sum[VBLOCK_STAT_WRITES],
+                   sum[VBLOCK_STAT_READ_BYTES], sum[VBLOCK_STAT_WRITE_BYTES],
+                   sum[VBLOCK_STAT_LOCK_WAIT_NS]);
+    
+    return 0;
+}
+DEFINE_SEQ_ATTRIBUTE(vblock_region_stats);
+
+static int vblock_latency_hist_show(struct seq_file *m, void *v)
+{
+    static const char * const names[VBLOCK_LAT_NR] = { "read", "write", "ioctl" };
+    struct vblock_device *dev = m->private;
+    u64 total;
+    int op, cpu, b;
+    
+    seq_puts(m, "# op latency_ns_from latency_ns_to count\n");
+    
+    for (op = 0; op < VBLOCK_LAT_NR; op++) {
+        for (b = 0; b < VBLOCK_LAT_BUCKETS; b++) {
+            total = 0;
+            for_each_possible_cpu(cpu)
+                total += READ_ONCE(per_cpu_ptr(dev->stats, cpu)->lat[op][b]);
+            
+            if (total)
+                seq_printf(m, "%s %llu %llu %llu\n", names[op], 1ULL << b, (2ULL << b) - 1,
+                           total);
         }
-        
-        memcpy(buffer + (i * REGION_SIZE), 
-               vblock_dev->regions[i].data, REGION_SIZE);
-        
-        up(&vblock_dev->regions[i].read_sem);
     }
     
-    // Open file for writing
-    file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (IS_ERR(file)) {
-        pr_err("Failed to open backup file: %s\n", path);
-        kfree(buffer);
-        return PTR_ERR(file);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vblock_latency_hist);
+
+static void vblock_stats_exit(struct vblock_device *dev)
+{
+    int cpu;
+    
+    debugfs_remove_recursive(dev->debugfs_dir);
+    dev->debugfs_dir = NULL;
+    
+    if (!dev->stats)
+        return;
+    
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(dev->stats, cpu)->regions);
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+}
+
+/*
+ * Each CPU gets its own region counters, so updates never share a cache
+ * line with another CPU. Readers of the debugfs files sum them up. At most
+ * VBLOCK_STAT_MAX_BUCKETS counters per CPU, a power of two of neighbouring
+ * regions share one past that. stats_enable is refused if the counters of
+ * all CPUs would still take more than VBLOCK_STAT_MAX_BYTES.
+ */
+static int vblock_stats_init(struct vblock_device *dev)
+{
+    struct vblock_stats *st;
+    u64 bytes;
+    int cpu;
+    
+    if (!stats_enable)
+        return 0;
+    
+    while (((dev->total_regions - 1) >> dev->stats_shift) >= VBLOCK_STAT_MAX_BUCKETS)
+        dev->stats_shift++;
+    dev->stats_buckets = ((dev->total_regions - 1) >> dev->stats_shift) + 1;
+    
+    bytes = (u64)dev->stats_buckets * sizeof(*st->regions) * num_possible_cpus();
+    if (bytes > VBLOCK_STAT_MAX_BYTES) {
+        pr_err("stats_enable needs %llu bytes of counters for %u CPUs, the limit is %u\n",
+               bytes, num_possible_cpus(), VBLOCK_STAT_MAX_BYTES);
+        return -E2BIG;
     }
     
-    // Write data to file
-    ret = kernel_write(file, buffer, TOTAL_SIZE, &pos);
-    if (ret < 0) {
-        pr_err("Failed to write backup file\n");
-    } else {
-        pr_info("Backup completed: %s (%d bytes)\n", path, ret);
+    dev->stats = alloc_percpu(struct vblock_stats);
+    if (!dev->stats)
+        goto fail;
+    
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(dev->stats, cpu);
+        st->regions = kvcalloc(dev->stats_buckets, sizeof(*st->regions), GFP_KERNEL);
+        if (!st->regions)
+            goto fail;
     }
     
-    filp_close(file, NULL);
-    kfree(buffer);
+    dev->debugfs_dir = debugfs_create_dir(BLK_DEVICE_NAME, NULL);
+    debugfs_create_file("region_stats", 0444, dev->debugfs_dir, dev,
+                        &vblock_region_stats_fops);
+    debugfs_create_file("latency_hist", 0444, dev->debugfs_dir, dev,
+                        &vblock_latency_hist_fops);
     
-    return ret;
+    return 0;
+
+fail:
+    pr_err("Failed to allocate statistics\n");
+    vblock_stats_exit(dev);
+    return -ENOMEM;
 }
-EXPORT_SYMBOL(vblock_backup_to_file);
 
 /**********************************************************************************
-* Helper Functions.
+* Range Locks.
 **********************************************************************************/
-static int parse_write_data(const char *buffer, size_t count, 
-                           loff_t *offset, int *key)
+static inline bool vblock_range_conflict(struct vblock_range *a, struct vblock_range *b)
 {
-    char *kernel_buf, *ptr, *token;
-    int ret = 0;
-    bool key_provided = false;
+    return a->exclusive || b->exclusive;
+}
+
+/*
+ * Release a range, or give up waiting for it. Later conflicting ranges
+ * counted this one when they were queued, so each of them has one less to
+ * wait for.
+ */
+static void vblock_range_unlock(struct vblock_device *dev, struct vblock_range *range)
+{
+    struct interval_tree_node *node;
+    struct vblock_range *other;
+    u64 start = range->node.start, last = range->node.last;
     
-    kernel_buf = kmalloc(count + 1, GFP_KERNEL);
-    if (!kernel_buf)
-        return -ENOMEM;
+    spin_lock(&dev->ranges_lock);
+    interval_tree_remove(&range->node, &dev->ranges);
     
-    // Copy and null-terminate
-    memcpy(kernel_buf, buffer, count);
-    kernel_buf[count] = '\0';
+    for (node = interval_tree_iter_first(&dev->ranges, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        other = container_of(node, struct vblock_range, node);
+        if (other->seq > range->seq && vblock_range_conflict(range, other) &&
+            --other->blocking == 0)
+            wake_up_process(other->task);
+    }
     
-    // Check for key:offset:data format
-    ptr = kernel_buf;
-    token = strsep(&ptr, ":");
+    spin_unlock(&dev->ranges_lock);
+}
+
+/*
+ * Lock bytes [pos, pos + len). Ranges are granted in arrival order among
+ * those that overlap: a range waits for every earlier overlapping one it
+ * conflicts with, shared ranges do not conflict with each other. Only a
+ * killable wait can fail, with -ERESTARTSYS. Page faults take ranges under
+ * mmap_lock, so user memory must not be faulted in while one is held.
+ */
+static int vblock_range_lock(struct vblock_device *dev, struct vblock_range *range,
+                             u64 pos, u64 len, bool exclusive, bool killable)
+{
+    struct interval_tree_node *node;
+    u64 last = pos + len - 1;
+    u64 start;
     
-    // Try to parse key
-    if (kstrtoint(token, 10, key) == 0) {
-        key_provided = true;
+    range->node.start = pos;
+    range->node.last = last;
+    range->exclusive = exclusive;
+    range->blocking = 0;
+    range->task = current;
+    
+    spin_lock(&dev->ranges_lock);
+    range->seq = dev->range_seq++;
+    
+    for (node = interval_tree_iter_first(&dev->ranges, pos, last); node;
+         node = interval_tree_iter_next(node, pos, last)) {
+        if (vblock_range_conflict(range, container_of(node, struct vblock_range, node)))
+            range->blocking++;
+    }
+    
+    interval_tree_insert(&range->node, &dev->ranges);
+    spin_unlock(&dev->ranges_lock);
+    
+    // Time spent waiting is charged to the first region of the range
+    if (!READ_ONCE(range->blocking))
+        return 0;
+    
+    start = vblock_stat_start(dev);
+    for (;;) {
+        set_current_state(killable ? TASK_KILLABLE : TASK_UNINTERRUPTIBLE);
+        if (!READ_ONCE(range->blocking))
+            break;
         
-        // Get offset
-        token = strsep(&ptr, ":");
-        if (!token) {
-            kfree(kernel_buf);
-            return -EINVAL;
+        if (killable && fatal_signal_pending(current)) {
+            __set_current_state(TASK_RUNNING);
+            vblock_range_unlock(dev, range);
+            return -ERESTARTSYS;
         }
         
-        if (kstrtoll(token, 10, offset) != 0) {
-            kfree(kernel_buf);
-            return -EINVAL;
-        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    
+    if (dev->stats)
+        vblock_stat_add(dev, pos / dev->region_size, VBLOCK_STAT_LOCK_WAIT_NS,
+                        ktime_get_ns() - start);
+    
+    return 0;
+}
+
+// Lock a whole region
+static inline int region_lock(struct vblock_device *dev, struct vblock_range *range,
+                              unsigned int region_num, bool exclusive, bool killable)
+{
+    return vblock_range_lock(dev, range, region_pos(dev, region_num), dev->region_size,
+                             exclusive, killable);
+}
+
+static inline bool vblock_mirror_caught_up(struct vblock_device *dev)
+{
+    return atomic_read(&dev->mirror_pending) < dev->mirror_max_lag;
+}
+
+/*
+ * Lock a span for writing. Writers hold snap_sem shared so a snapshot never
+ * splits a write from its copy. The mirror lag is waited out first, while
+ * no lock is held that the mirror thread could need.
+ */
+static int vblock_write_lock(struct vblock_device *dev, struct vblock_range *range,
+                             u64 pos, u64 len, bool killable)
+{
+    if (dev->nr_replicas) {
+        if (!killable)
+            wait_event(dev->mirror_wait, vblock_mirror_caught_up(dev));
+        else if (wait_event_killable(dev->mirror_wait, vblock_mirror_caught_up(dev)))
+            return -ERESTARTSYS;
+    }
+    
+    percpu_down_read(&dev->snap_sem);
+    if (vblock_range_lock(dev, range, pos, len, true, killable)) {
+        percpu_up_read(&dev->snap_sem);
+        return -ERESTARTSYS;
+    }
+    
+    return 0;
+}
+
+static void vblock_write_unlock(struct vblock_device *dev, struct vblock_range *range)
+{
+    vblock_range_unlock(dev, range);
+    percpu_up_read(&dev->snap_sem);
+}
+
+// Checking a read against the checksum needs the whole region still
+static int vblock_read_lock(struct vblock_device *dev, struct vblock_range *range,
+                            u64 pos, u64 len, bool killable)
+{
+    u64 end = pos + len;
+    
+    if (READ_ONCE(verify_reads)) {
+        pos = round_down(pos, dev->region_size);
+        end = round_up(end, dev->region_size);
+    }
+    
+    return vblock_range_lock(dev, range, pos, end - pos, false, killable);
+}
+
+/**********************************************************************************
+* Region Helpers.
+**********************************************************************************/
+/*
+ * Log a region for the mirror thread, once until it has been copied. Called
+ * with the region, or the part of it being written, locked exclusively.
+ */
+static void vblock_mirror_queue(struct vblock_device *dev, unsigned int region_num)
+{
+    u32 entry = region_num;
+    
+    if (!dev->nr_replicas || test_and_set_bit(region_num, dev->mirror_queued))
+        return;
+    
+    // A full log is caught up on by scanning mirror_queued
+    if (!kfifo_in_spinlocked(&dev->mirror_log, &entry, 1, &dev->mirror_log_lock))
+        WRITE_ONCE(dev->mirror_overflow, true);
+    
+    if (atomic_inc_return(&dev->mirror_pending) == 1)
+        wake_up(&dev->mirror_kick);
+}
+
+static struct page *vblock_alloc_page(struct xarray *pages, pgoff_t index, gfp_t gfp)
+{
+    struct page *page, *old;
+    
+    page = xa_load(pages, index);
+    if (page)
+        return page;
+    
+    page = alloc_page(gfp | __GFP_ZERO);
+    if (!page)
+        return NULL;
+    
+    old = xa_cmpxchg(pages, index, NULL, page, gfp);
+    if (old) {
+        __free_page(page);
+        return xa_is_err(old) ? NULL : old;
+    }
+    
+    return page;
+}
+
+/*
+ * The copy helpers below work on a span inside one region, which always
+ * lies inside one page. Holes read as zeroes.
+ */
+static void vblock_load(struct xarray *pages, u64 pos, void *dst, size_t len)
+{
+    struct page *page = xa_load(pages, pos >> PAGE_SHIFT);
+    void *addr;
+    
+    if (!page) {
+        memset(dst, 0, len);
+        return;
+    }
+    
+    addr = kmap_local_page(page);
+    memcpy(dst, addr + offset_in_page(pos), len);
+    kunmap_local(addr);
+}
+
+// Does not fault, -EFAULT if dst is not present
+static int vblock_load_user(struct xarray *pages, u64 pos, char __user *dst, size_t len)
+{
+    struct page *page = xa_load(pages, pos >> PAGE_SHIFT);
+    unsigned long left;
+    void *addr;
+    
+    pagefault_disable();
+    if (!page) {
+        left = clear_user(dst, len);
     } else {
-        // No key provided, entire string is offset
-        if (kstrtoll(kernel_buf, 10, offset) != 0) {
-            kfree(kernel_buf);
-            return -EINVAL;
-        }
-        *key = 0;
+        addr = kmap_local_page(page);
+        left = copy_to_user(dst, addr + offset_in_page(pos), len);
+        kunmap_local(addr);
+    }
+    pagefault_enable();
+    
+    return left ? -EFAULT : 0;
+}
+
+// Zeroes written to a hole are dropped, the hole already reads as zeroes
+static int vblock_store(struct xarray *pages, u64 pos, const void *src,
+                        size_t len, gfp_t gfp)
+{
+    struct page *page;
+    void *addr;
+    
+    if (!xa_load(pages, pos >> PAGE_SHIFT) && !memchr_inv(src, 0, len))
+        return 0;
+    
+    page = vblock_alloc_page(pages, pos >> PAGE_SHIFT, gfp);
+    if (!page)
+        return -ENOMEM;
+    
+    addr = kmap_local_page(page);
+    memcpy(addr + offset_in_page(pos), src, len);
+    kunmap_local(addr);
+    
+    return 0;
+}
+
+/*
+ * Whether src holds only zeroes, read through a small bounce buffer up to
+ * the first non-zero chunk. Does not fault, -EFAULT if src is not present.
+ */
+static int vblock_user_is_zero(const char __user *src, size_t len)
+{
+    u64 buf[8];
+    size_t n;
+    unsigned long left;
+    
+    while (len > 0) {
+        n = min(len, sizeof(buf));
+        
+        pagefault_disable();
+        left = copy_from_user(buf, src, n);
+        pagefault_enable();
+        
+        if (left)
+            return -EFAULT;
+        if (memchr_inv(buf, 0, n))
+            return 0;
+        
+        src += n;
+        len -= n;
+    }
+    
+    return 1;
+}
+
+/*
+ * Copy straight from user space into the store. Like vblock_store(), zeroes
+ * written to a hole are dropped. Does not fault, -EFAULT if src is not
+ * present, in which case part of it may have been stored.
+ */
+static int vblock_store_user(struct xarray *pages, u64 pos, const char __user *src,
+                             size_t len, gfp_t gfp)
+{
+    struct page *page;
+    unsigned long left;
+    void *addr;
+    int zero;
+    
+    if (!xa_load(pages, pos >> PAGE_SHIFT)) {
+        zero = vblock_user_is_zero(src, len);
+        if (zero)
+            return zero < 0 ? zero : 0;
+    }
+    
+    page = vblock_alloc_page(pages, pos >> PAGE_SHIFT, gfp);
+    if (!page)
+        return -ENOMEM;
+    
+    addr = kmap_local_page(page);
+    pagefault_disable();
+    left = copy_from_user(addr + offset_in_page(pos), src, len);
+    pagefault_enable();
+    kunmap_local(addr);
+    
+    return left ? -EFAULT : 0;
+}
+
+static void vblock_zero(struct xarray *pages, u64 pos, size_t len)
+{
+    struct page *page = xa_load(pages, pos >> PAGE_SHIFT);
+    void *addr;
+    
+    if (!page)
+        return;
+    
+    addr = kmap_local_page(page);
+    memset(addr + offset_in_page(pos), 0, len);
+    kunmap_local(addr);
+}
+
+// crc32c through the crypto API, which picks the accelerated implementation
+static u32 vblock_csum_buf(struct vblock_device *dev, const void *buf)
+{
+    SHASH_DESC_ON_STACK(desc, dev->csum_tfm);
+    u32 csum = 0;
+    
+    desc->tfm = dev->csum_tfm;
+    crypto_shash_digest(desc, buf, dev->region_size, (u8 *)&csum);
+    return csum;
+}
+
+/**********************************************************************************
+* Compression.
+**********************************************************************************/
+static inline struct mutex *vblock_zlock(struct vblock_device *dev, pgoff_t index)
+{
+    return &dev->zlocks[index & dev->lock_mask];
+}
+
+// Foreground access keeps a page uncompressed for another interval
+static inline void vblock_touch(struct vblock_device *dev, pgoff_t index)
+{
+    struct page *page;
+    
+    if (!dev->ztfm)
+        return;
+    
+    page = xa_load(&dev->pages, index);
+    if (page && !PageReferenced(page))
+        SetPageReferenced(page);
+}
+
+static int vblock_zdecompress(struct vblock_zcache *zc, struct vblock_zpage *z,
+                              struct scatterlist *out)
+{
+    struct scatterlist src;
+    int ret;
+    
+    sg_init_one(&src, z->data, z->len);
+    acomp_request_set_params(zc->req, &src, out, z->len, PAGE_SIZE);
+    
+    ret = crypto_acomp_decompress(zc->req);
+    if (!ret && zc->req->dlen != PAGE_SIZE)
+        ret = -EIO;
+    
+    return ret;
+}
+
+/*
+ * The decompressed copy of z, from this CPU's cache or decompressed into
+ * its least recently used slot. Called with the page's zlock and zc->lock
+ * held, the copy is valid until zc->lock is released. NULL if z is corrupt.
+ */
+static void *vblock_zcache_get(struct vblock_zcache *zc, struct vblock_zpage *z)
+{
+    struct scatterlist out;
+    unsigned int i, lru = 0;
+    
+    for (i = 0; i < VBLOCK_ZCACHE_SLOTS; i++) {
+        if (zc->gen[i] == z->gen)
+            goto hit;
+        if (zc->used[i] < zc->used[lru])
+            lru = i;
+    }
+    
+    i = lru;
+    zc->gen[i] = 0;
+    sg_init_one(&out, zc->data[i], PAGE_SIZE);
+    if (vblock_zdecompress(zc, z, &out))
+        return NULL;
+    zc->gen[i] = z->gen;
+
+hit:
+    zc->used[i] = ++zc->tick;
+    return zc->data[i];
+}
+
+/*
+ * Like vblock_load(), a compressed primary page is read through the cache.
+ * Returns 0, or -EIO with dst zeroed if the compressed copy is corrupt.
+ * Called with the span locked.
+ */
+static int vblock_read_span(struct vblock_device *dev, struct xarray *pages,
+                            u64 pos, void *dst, size_t len)
+{
+    pgoff_t index = pos >> PAGE_SHIFT;
+    struct vblock_zcache *zc;
+    struct vblock_zpage *z;
+    void *data = NULL;
+    
+    if (pages != &dev->pages || !dev->ztfm || xa_load(pages, index)) {
+        vblock_load(pages, pos, dst, len);
+        return 0;
+    }
+    
+    mutex_lock(vblock_zlock(dev, index));
+    
+    // Gone if a writer of another part of the page restored it meanwhile
+    z = xa_load(&dev->zpages, index);
+    if (!z) {
+        mutex_unlock(vblock_zlock(dev, index));
+        vblock_load(pages, pos, dst, len);
+        return 0;
+    }
+    
+    zc = raw_cpu_ptr(dev->zcache);
+    mutex_lock(&zc->lock);
+    data = vblock_zcache_get(zc, z);
+    if (data)
+        memcpy(dst, data + offset_in_page(pos), len);
+    mutex_unlock(&zc->lock);
+    mutex_unlock(vblock_zlock(dev, index));
+    
+    if (!data) {
+        pr_err_ratelimited("Compressed page %lu is corrupted\n", index);
+        memset(dst, 0, len);
+        return -EIO;
+    }
+    
+    return 0;
+}
+
+/*
+ * Like vblock_load_user(), the copy does not fault and -EFAULT asks the
+ * caller to fault dst in with no lock held and retry.
+ */
+static int vblock_read_span_user(struct vblock_device *dev, struct xarray *pages,
+                                 u64 pos, char __user *dst, size_t len)
+{
+    pgoff_t index = pos >> PAGE_SHIFT;
+    struct vblock_zcache *zc;
+    struct vblock_zpage *z;
+    void *data;
+    int ret;
+    
+    if (pages != &dev->pages || !dev->ztfm || xa_load(pages, index))
+        return vblock_load_user(pages, pos, dst, len);
+    
+    mutex_lock(vblock_zlock(dev, index));
+    
+    z = xa_load(&dev->zpages, index);
+    if (!z) {
+        mutex_unlock(vblock_zlock(dev, index));
+        return vblock_load_user(pages, pos, dst, len);
+    }
+    
+    zc = raw_cpu_ptr(dev->zcache);
+    mutex_lock(&zc->lock);
+    data = vblock_zcache_get(zc, z);
+    ret = data ? copy_to_user_nofault(dst, data + offset_in_page(pos), len) : -EIO;
+    mutex_unlock(&zc->lock);
+    mutex_unlock(vblock_zlock(dev, index));
+    
+    if (ret == -EIO)
+        pr_err_ratelimited("Compressed page %lu is corrupted\n", index);
+    
+    return ret;
+}
+
+// Checksum of a region in a compressed page, false if the page is not compressed
+static bool vblock_zregion_csum(struct vblock_device *dev, unsigned int region_num, u32 *csum)
+{
+    u64 pos = region_pos(dev, region_num);
+    pgoff_t index = pos >> PAGE_SHIFT;
+    struct vblock_zcache *zc;
+    struct vblock_zpage *z;
+    void *data;
+    
+    if (!dev->ztfm || !xa_load(&dev->zpages, index))
+        return false;
+    
+    mutex_lock(vblock_zlock(dev, index));
+    
+    z = xa_load(&dev->zpages, index);
+    if (z) {
+        zc = raw_cpu_ptr(dev->zcache);
+        mutex_lock(&zc->lock);
+        data = vblock_zcache_get(zc, z);
+        // A corrupt page gets a checksum that never matches
+        *csum = data ? vblock_csum_buf(dev, data + offset_in_page(pos)) :
+                       ~dev->csums[region_num];
+        mutex_unlock(&zc->lock);
+    }
+    
+    mutex_unlock(vblock_zlock(dev, index));
+    return z != NULL;
+}
+
+/*
+ * Move a compressed page back to pages, 0 if it was not compressed. Called
+ * with the page's zlock held.
+ */
+static int vblock_zrestore_locked(struct vblock_device *dev, pgoff_t index, gfp_t gfp)
+{
+    struct vblock_zcache *zc;
+    struct vblock_zpage *z;
+    struct scatterlist out;
+    struct page *page;
+    int ret;
+    
+    z = xa_load(&dev->zpages, index);
+    if (!z)
+        return 0;
+    
+    page = alloc_page(gfp);
+    if (!page)
+        return -ENOMEM;
+    
+    sg_init_table(&out, 1);
+    sg_set_page(&out, page, PAGE_SIZE, 0);
+    
+    zc = raw_cpu_ptr(dev->zcache);
+    mutex_lock(&zc->lock);
+    ret = vblock_zdecompress(zc, z, &out);
+    mutex_unlock(&zc->lock);
+    
+    if (ret) {
+        pr_err_ratelimited("Compressed page %lu is corrupted\n", index);
+        ret = -EIO;
+    } else {
+        ret = xa_err(xa_store(&dev->pages, index, page, gfp));
+    }
+    
+    if (ret) {
+        __free_page(page);
+        return ret;
+    }
+    
+    SetPageReferenced(page);
+    xa_erase(&dev->zpages, index);
+    kfree(z);
+    return 0;
+}
+
+/*
+ * Called before a page is written, with at least part of it locked. Only the
+ * compressor adds to zpages, and it would have to lock the whole page first.
+ */
+static int vblock_zrestore(struct vblock_device *dev, pgoff_t index, gfp_t gfp)
+{
+    int ret;
+    
+    if (!dev->ztfm || !xa_load(&dev->zpages, index))
+        return 0;
+    
+    mutex_lock(vblock_zlock(dev, index));
+    ret = vblock_zrestore_locked(dev, index, gfp);
+    mutex_unlock(vblock_zlock(dev, index));
+    
+    return ret;
+}
+
+/*
+ * Compress a page unless it was touched since the last pass. Pages that are
+ * mapped or referenced by anyone but the store stay, and so do pages that
+ * do not shrink below 3/4 of their size. Allocations are GFP_NOIO since a
+ * filesystem on the disk could otherwise recurse into the range we hold.
+ */
+static void vblock_zcompress(struct vblock_device *dev, pgoff_t index)
+{
+    u64 pos = (u64)index << PAGE_SHIFT;
+    struct vblock_zpage *z = NULL;
+    struct scatterlist src, out;
+    struct vblock_zcache *zc;
+    struct vblock_range range;
+    struct page *page;
+    
+    vblock_range_lock(dev, &range, pos, min_t(u64, PAGE_SIZE, dev->size - pos), true, false);
+    mutex_lock(vblock_zlock(dev, index));
+    
+    page = xa_load(&dev->pages, index);
+    if (!page || TestClearPageReferenced(page) || !trylock_page(page))
+        goto out;
+    
+    if (page_mapped(page) || page_ref_count(page) != 1)
+        goto unlock;
+    
+    sg_init_table(&src, 1);
+    sg_set_page(&src, page, PAGE_SIZE, 0);
+    
+    zc = raw_cpu_ptr(dev->zcache);
+    mutex_lock(&zc->lock);
+    sg_init_one(&out, zc->buf, 2 * PAGE_SIZE);
+    acomp_request_set_params(zc->req, &src, &out, PAGE_SIZE, 2 * PAGE_SIZE);
+    if (!crypto_acomp_compress(zc->req) && zc->req->dlen <= PAGE_SIZE * 3 / 4) {
+        z = kmalloc(struct_size(z, data, zc->req->dlen), GFP_NOIO | __GFP_NOWARN);
+        if (z) {
+            z->gen = atomic64_inc_return(&dev->zgen);
+            z->len = zc->req->dlen;
+            memcpy(z->data, zc->buf, z->len);
+        }
+    }
+    mutex_unlock(&zc->lock);
+    
+    if (!z || xa_is_err(xa_store(&dev->zpages, index, z, GFP_NOIO))) {
+        kfree(z);
+        goto unlock;
+    }
+    
+    xa_erase(&dev->pages, index);
+    unlock_page(page);
+    mutex_unlock(vblock_zlock(dev, index));
+    vblock_range_unlock(dev, &range);
+    put_page(page);
+    return;
+
+unlock:
+    unlock_page(page);
+out:
+    mutex_unlock(vblock_zlock(dev, index));
+    vblock_range_unlock(dev, &range);
+}
+
+/*
+ * Every compress_interval_ms, compresses the pages that were not touched
+ * since the previous pass. Runs at the lowest priority and locks one page
+ * at a time.
+ */
+static int vblock_zthread(void *data)
+{
+    struct vblock_device *dev = data;
+    unsigned long index;
+    void *entry;
+    
+    set_user_nice(current, MAX_NICE);
+    
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(compress_interval_ms));
+        
+        xa_for_each(&dev->pages, index, entry) {
+            if (kthread_should_stop())
+                break;
+            
+            vblock_zcompress(dev, index);
+            cond_resched();
+        }
+    }
+    
+    return 0;
+}
+
+static void vblock_compress_exit(struct vblock_device *dev)
+{
+    struct vblock_zcache *zc;
+    struct vblock_zpage *z;
+    unsigned long index;
+    unsigned int i;
+    int cpu;
+    
+    if (dev->zthread) {
+        kthread_stop(dev->zthread);
+        dev->zthread = NULL;
+    }
+    
+    xa_for_each(&dev->zpages, index, z)
+        kfree(z);
+    xa_destroy(&dev->zpages);
+    
+    if (dev->zcache) {
+        for_each_possible_cpu(cpu) {
+            zc = per_cpu_ptr(dev->zcache, cpu);
+            if (zc->req)
+                acomp_request_free(zc->req);
+            kfree(zc->buf);
+            for (i = 0; i < VBLOCK_ZCACHE_SLOTS; i++)
+                kfree(zc->data[i]);
+        }
+        free_percpu(dev->zcache);
+        dev->zcache = NULL;
+    }
+    
+    kfree(dev->zlocks);
+    dev->zlocks = NULL;
+    
+    if (dev->ztfm) {
+        crypto_free_acomp(dev->ztfm);
+        dev->ztfm = NULL;
+    }
+}
+
+/*
+ * Set up compression with the synchronous implementation of the compress
+ * algorithm. The compressor thread is started separately, once the device
+ * is up.
+ */
+static int vblock_compress_init(struct vblock_device *dev)
+{
+    struct vblock_zcache *zc;
+    unsigned int i;
+    int cpu, ret;
+    
+    xa_init(&dev->zpages);
+    atomic64_set(&dev->zgen, 0);
+    
+    if (!compress || !*compress)
+        return 0;
+    
+    dev->ztfm = crypto_alloc_acomp(compress, 0, CRYPTO_ALG_ASYNC);
+    if (IS_ERR(dev->ztfm)) {
+        pr_err("Compression algorithm %s is not available\n", compress);
+        ret = PTR_ERR(dev->ztfm);
+        dev->ztfm = NULL;
+        return ret;
+    }
+    
+    dev->zlocks = kcalloc(dev->lock_mask + 1, sizeof(struct mutex), GFP_KERNEL);
+    dev->zcache = alloc_percpu(struct vblock_zcache);
+    if (!dev->zlocks || !dev->zcache)
+        goto fail;
+    
+    for (i = 0; i <= dev->lock_mask; i++)
+        mutex_init(&dev->zlocks[i]);
+    
+    for_each_possible_cpu(cpu) {
+        zc = per_cpu_ptr(dev->zcache, cpu);
+        mutex_init(&zc->lock);
+        zc->req = acomp_request_alloc(dev->ztfm);
+        zc->buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+        if (!zc->req || !zc->buf)
+            goto fail;
+        
+        acomp_request_set_callback(zc->req, 0, NULL, NULL);
+        for (i = 0; i < VBLOCK_ZCACHE_SLOTS; i++) {
+            zc->data[i] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+            if (!zc->data[i])
+                goto fail;
+        }
+    }
+    
+    pr_info("Compressing cold pages with %s\n", compress);
+    return 0;
+
+fail:
+    pr_err("Failed to allocate compression state\n");
+    vblock_compress_exit(dev);
+    return -ENOMEM;
+}
+
+/**********************************************************************************
+* Region Access.
+**********************************************************************************/
+// Holes have the checksum of a zeroed region
+static u32 vblock_region_csum(struct vblock_device *dev, struct xarray *pages,
+                              unsigned int region_num)
+{
+    u64 pos = region_pos(dev, region_num);
+    struct page *page = xa_load(pages, pos >> PAGE_SHIFT);
+    void *addr;
+    u32 csum;
+    
+    if (!page && pages == &dev->pages && vblock_zregion_csum(dev, region_num, &csum))
+        return csum;
+    
+    if (!page)
+        return dev->zero_csum;
+    
+    addr = kmap_local_page(page);
+    csum = vblock_csum_buf(dev, addr + offset_in_page(pos));
+    kunmap_local(addr);
+    
+    return csum;
+}
+
+// Called with the whole region locked, a stale checksum is not checked
+static inline bool vblock_csum_ok(struct vblock_device *dev, struct xarray *pages,
+                                  unsigned int region_num)
+{
+    return test_bit(region_num, dev->csum_stale) ||
+           vblock_region_csum(dev, pages, region_num) == dev->csums[region_num];
+}
+
+static void vblock_scrub_suspect(struct vblock_device *dev, unsigned int region_num)
+{
+    pr_err_ratelimited("Checksum mismatch in region %u\n", region_num);
+    set_bit(region_num, dev->scrub_suspect);
+    if (dev->scrub_thread)
+        wake_up_process(dev->scrub_thread);
+}
+
+/*
+ * Pick the copy to read a region from. Reads of a region that is not
+ * waiting for the mirror are spread over the primary and the in-sync memory
+ * replicas. With verify_reads a copy that fails its checksum is passed over
+ * for the next one and reported to the scrubber; NULL means none was good.
+ * Called with the whole region locked.
+ */
+static struct xarray *vblock_read_pages(struct vblock_device *dev, unsigned int region_num)
+{
+    struct xarray *pages;
+    unsigned int nr = 1, pick = 0, i;
+    
+    vblock_touch(dev, region_pos(dev, region_num) >> PAGE_SHIFT);
+    
+    if (dev->nr_mem_replicas && !test_bit(region_num, dev->mirror_queued)) {
+        nr += dev->nr_mem_replicas;
+        pick = (region_num + raw_smp_processor_id()) % nr;
+    }
+    
+    for (i = 0; i < nr; i++, pick = (pick + 1) % nr) {
+        if (pick == 0)
+            pages = &dev->pages;
+        else if (READ_ONCE(dev->replicas[pick - 1].in_sync))
+            pages = &dev->replicas[pick - 1].pages;
+        else
+            continue;
+        
+        if (!READ_ONCE(verify_reads) || vblock_csum_ok(dev, pages, region_num))
+            return pages;
+        
+        vblock_scrub_suspect(dev, region_num);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Bookkeeping after a region changed, called with the written span locked.
+ * Each writer sums the region after its own store, so the last sum taken
+ * under the meta lock covers every write that finished.
+ */
+static void vblock_region_changed(struct vblock_device *dev, u64 pos)
+{
+    unsigned int region_num = pos / dev->region_size;
+    
+    vblock_touch(dev, pos >> PAGE_SHIFT);
+    vblock_mark_dirty(dev, region_num);
+    mutex_lock(region_meta_lock(dev, region_num));
+    dev->csums[region_num] = vblock_region_csum(dev, &dev->pages, region_num);
+    mutex_unlock(region_meta_lock(dev, region_num));
+    vblock_mirror_queue(dev, region_num);
+}
+
+/*
+ * Save a region into the newest snapshot before its first change since that
+ * snapshot was taken. Called with snap_sem held for read and the span about
+ * to be written locked; the first writer of the region copies it under the
+ * meta lock, before any other writer of the region gets to store.
+ */
+static int vblock_cow_region(struct vblock_device *dev, unsigned int region_num, gfp_t gfp)
+{
+    struct vblock_snapshot *snap;
+    void *copy;
+    int ret = 0;
+    
+    if (list_empty(&dev->snapshots))
+        return 0;
+    
+    snap = list_last_entry(&dev->snapshots, struct vblock_snapshot, list);
+    mutex_lock(region_meta_lock(dev, region_num));
+    if (dev->cow_gen[region_num] >= snap->gen)
+        goto out;
+    
+    copy = kmalloc(dev->region_size, gfp);
+    if (!copy) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    ret = vblock_read_span(dev, &dev->pages, region_pos(dev, region_num), copy,
+                           dev->region_size);
+    if (!ret && xa_is_err(xa_store(&snap->regions, region_num, copy, gfp)))
+        ret = -ENOMEM;
+    if (ret) {
+        kfree(copy);
+        goto out;
+    }
+    
+    dev->cow_gen[region_num] = snap->gen;
+out:
+    mutex_unlock(region_meta_lock(dev, region_num));
+    return ret;
+}
+
+// Called with the span locked by vblock_write_lock()
+static int vblock_write_span(struct vblock_device *dev, u64 pos,
+                             const void *src, size_t len, gfp_t gfp)
+{
+    int ret;
+    
+    ret = vblock_zrestore(dev, pos >> PAGE_SHIFT, gfp);
+    if (!ret)
+        ret = vblock_cow_region(dev, pos / dev->region_size, gfp);
+    if (ret)
+        return ret;
+    
+    ret = vblock_store(&dev->pages, pos, src, len, gfp);
+    if (!ret)
+        vblock_region_changed(dev, pos);
+    
+    return ret;
+}
+
+// Called with the span locked by vblock_write_lock()
+static int vblock_write_span_user(struct vblock_device *dev, u64 pos,
+                                  const char __user *src, size_t len)
+{
+    int ret;
+    
+    ret = vblock_zrestore(dev, pos >> PAGE_SHIFT, GFP_KERNEL);
+    if (!ret)
+        ret = vblock_cow_region(dev, pos / dev->region_size, GFP_KERNEL);
+    if (ret)
+        return ret;
+    
+    // A short copy may still have changed part of the region
+    ret = vblock_store_user(&dev->pages, pos, src, len, GFP_KERNEL);
+    if (!ret || ret == -EFAULT)
+        vblock_region_changed(dev, pos);
+    
+    return ret;
+}
+
+/*
+ * Drop a page from the store. The page lock keeps a racing fault from
+ * mapping it once it is gone from the xarray, mappings made before that
+ * are zapped, and the last reference frees it.
+ */
+static void vblock_free_page(struct vblock_device *dev, pgoff_t index)
+{
+    struct page *page = xa_load(&dev->pages, index);
+    
+    if (dev->ztfm) {
+        mutex_lock(vblock_zlock(dev, index));
+        kfree(xa_erase(&dev->zpages, index));
+        mutex_unlock(vblock_zlock(dev, index));
+    }
+    
+    if (!page)
+        return;
+    
+    lock_page(page);
+    xa_erase(&dev->pages, index);
+    unlock_page(page);
+    vblock_zap_page(dev, index);
+    put_page(page);
+}
+
+/*
+ * Zero [pos, pos + len), which may span any number of regions. With unmap,
+ * pages the span covers whole are freed and read back from the hole, only
+ * the partial pages at its ends are cleared. Freeing a page is safe since
+ * nobody else can hold part of the locked span. Called with the span locked
+ * by vblock_write_lock(), gfp is used for the snapshot copies and for pages
+ * brought back from the compressed store.
+ */
+static int vblock_discard(struct vblock_device *dev, u64 pos, u64 len, bool unmap,
+                          gfp_t gfp)
+{
+    unsigned int first = pos / dev->region_size;
+    unsigned int last = (pos + len - 1) / dev->region_size;
+    unsigned int region_num;
+    u64 end = pos + len, next;
+    int ret;
+    
+    if (len == 0)
+        return 0;
+    
+    for (region_num = first; region_num <= last; region_num++) {
+        ret = vblock_cow_region(dev, region_num, gfp);
+        if (ret)
+            return ret;
+    }
+    
+    while (pos < end) {
+        next = min(round_down(pos, PAGE_SIZE) + PAGE_SIZE, end);
+        if (unmap && !offset_in_page(pos) && (next - pos == PAGE_SIZE || next == dev->size)) {
+            vblock_free_page(dev, pos >> PAGE_SHIFT);
+        } else {
+            ret = vblock_zrestore(dev, pos >> PAGE_SHIFT, gfp);
+            if (ret)
+                break;
+            vblock_zero(&dev->pages, pos, next - pos);
+        }
+        pos = next;
+    }
+    
+    for (region_num = first; region_num <= last; region_num++)
+        vblock_region_changed(dev, region_pos(dev, region_num));
+    
+    return ret;
+}
+
+static void vblock_free_pages(struct xarray *pages)
+{
+    struct page *page;
+    unsigned long index;
+    
+    xa_for_each(pages, index, page)
+        __free_page(page);
+    xa_destroy(pages);
+}
+
+/**********************************************************************************
+* Exported Backup Function.
+**********************************************************************************/
+/*
+ * Copy the dirty regions of one page to the backup file at their offsets.
+ * The dirty bits are cleared and the page's mappings zapped before the
+ * copy, so a write racing with the backup marks its region dirty again and
+ * is picked up by the next one. On failure the bits are set again.
+ */
+static int vblock_backup_page(struct vblock_device *dev, struct file *file,
+                              pgoff_t index, char *buffer)
+{
+    DECLARE_BITMAP(mask, PAGE_SIZE / SECTOR_SIZE);
+    struct vblock_range range;
+    unsigned int first, nr, i, run;
+    loff_t pos;
+    ssize_t written;
+    int ret = 0;
+    
+    nr = page_regions(dev, index, &first);
+    
+    bitmap_zero(mask, nr);
+    for (i = 0; i < nr; i++) {
+        if (test_and_clear_bit(first + i, dev->dirty))
+            __set_bit(i, mask);
+    }
+    
+    if (bitmap_empty(mask, nr))
+        return 0;
+    
+    vblock_zap_page(dev, index);
+    
+    for_each_set_bit(i, mask, nr) {
+        if (region_lock(dev, &range, first + i, false, true)) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+        
+        ret = vblock_read_span(dev, &dev->pages, region_pos(dev, first + i),
+                               buffer + i * dev->region_size, dev->region_size);
+        
+        vblock_range_unlock(dev, &range);
+        
+        if (ret)
+            goto out;
+    }
+    
+    // One write per run of adjacent dirty regions
+    i = find_first_bit(mask, nr);
+    while (i < nr) {
+        run = find_next_zero_bit(mask, nr, i) - i;
+        pos = region_pos(dev, first + i);
+        
+        written = kernel_write(file, buffer + i * dev->region_size,
+                               run * dev->region_size, &pos);
+        if (written != run * dev->region_size) {
+            ret = written < 0 ? written : -EIO;
+            goto out;
+        }
+        
+        i = find_next_bit(mask, nr, i + run);
+    }
+    
+    return 0;
+
+out:
+    for_each_set_bit(i, mask, nr)
+        set_bit(first + i, dev->dirty);
+    
+    return ret;
+}
+
+/*
+ * Write the regions changed since the last backup to path, page by page
+ * through a bounce buffer. The first backup to a path, or the first after
+ * switching paths, rewrites the file from scratch with every allocated
+ * page; pages that were never written are left as holes in the file.
+ * Returns 0 or a negative error.
+ */
+int vblock_backup_to_file(const char *path)
+{
+    struct vblock_device *dev = vblock_dev;
+    struct file *file;
+    struct page *page;
+    struct vblock_zpage *zpage;
+    unsigned long index;
+    unsigned int first, nr, region_num, pages = 0;
+    char *buffer;
+    bool full;
+    int ret = 0;
+    
+    if (!dev) {
+        pr_err("Device not initialized\n");
+        return -ENODEV;
+    }
+    
+    buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buffer) {
+        pr_err("Failed to allocate backup buffer\n");
+        return -ENOMEM;
+    }
+    
+    mutex_lock(&dev->backup_mutex);
+    
+    // Only a file that holds a complete earlier backup can be updated in place
+    full = !dev->backup_file || strcmp(dev->backup_file, path) != 0;
+    
+    // Open file for writing
+    file = filp_open(path, O_WRONLY | O_CREAT | (full ? O_TRUNC : 0), 0644);
+    if (IS_ERR(file)) {
+        pr_err("Failed to open backup file: %s\n", path);
+        ret = PTR_ERR(file);
+        goto unlock;
+    }
+    
+    if (full) {
+        kfree(dev->backup_file);
+        dev->backup_file = NULL;
+        
+        xa_for_each(&dev->pages, index, page) {
+            nr = page_regions(dev, index, &first);
+            for (region_num = first; region_num < first + nr; region_num++)
+                set_bit(region_num, dev->dirty);
+        }
+        
+        xa_for_each(&dev->zpages, index, zpage) {
+            nr = page_regions(dev, index, &first);
+            for (region_num = first; region_num < first + nr; region_num++)
+                set_bit(region_num, dev->dirty);
+        }
+    }
+    
+    // Visit each page holding a dirty region once
+    region_num = find_first_bit(dev->dirty, dev->total_regions);
+    while (region_num < dev->total_regions) {
+        index = region_pos(dev, region_num) >> PAGE_SHIFT;
+        
+        ret = vblock_backup_page(dev, file, index, buffer);
+        if (ret) {
+            pr_err("Failed to write backup file\n");
+            goto out;
+        }
+        pages++;
+        
+        nr = page_regions(dev, index, &first);
+        region_num = find_next_bit(dev->dirty, dev->total_regions, first + nr);
+    }
+    
+    if (full) {
+        // Extend the file over trailing holes
+        ret = vfs_truncate(&file->f_path, dev->size);
+        if (ret == 0) {
+            dev->backup_file = kstrdup(path, GFP_KERNEL);
+            pr_info("Backup completed: %s (%llu bytes)\n", path, dev->size);
+        }
+    } else {
+        pr_debug("Incremental backup: %s (%u pages)\n", path, pages);
+    }
+
+out:
+    filp_close(file, NULL);
+unlock:
+    mutex_unlock(&dev->backup_mutex);
+    kfree(buffer);
+    
+    return ret;
+}
+EXPORT_SYMBOL(vblock_backup_to_file);
+
+static void vblock_backup_work(struct work_struct *work)
+{
+    struct vblock_device *dev = container_of(to_delayed_work(work),
+                                             struct vblock_device, backup_work);
+    int ret;
+    
+    ret = vblock_backup_to_file(backup_path);
+    if (ret)
+        pr_err("Scheduled backup to %s failed: %d\n", backup_path, ret);
+    
+    queue_delayed_work(system_unbound_wq, &dev->backup_work,
+                       msecs_to_jiffies(backup_interval_ms));
+}
+
+/**********************************************************************************
+* Mirroring.
+**********************************************************************************/
+static void vblock_replica_fail(struct vblock_device *dev, unsigned int i)
+{
+    WRITE_ONCE(dev->replicas[i].in_sync, false);
+    pr_err("Mirror replica %u failed, it is out of sync\n", i);
+}
+
+/*
+ * Bring the replicas up to date with one region. Memory replicas are
+ * updated with the whole region locked, together with clearing its queued
+ * bit, so a reader that finds the bit clear may use any of them. The page is
+ * locked and its mappings zapped before the copy: a write through a
+ * mapping after that faults and logs the region again. The copy is checked
+ * against the region's checksum, or provides it after a mapped write, and
+ * every memory replica is checked again once written.
+ */
+static void vblock_mirror_region(struct vblock_device *dev, unsigned int region_num)
+{
+    u64 pos = region_pos(dev, region_num);
+    struct vblock_replica *rep;
+    struct vblock_range range;
+    struct page *page;
+    unsigned int i;
+    loff_t off;
+    u32 csum;
+    
+    region_lock(dev, &range, region_num, true, false);
+    
+    // Already copied by an overflow scan
+    if (!test_and_clear_bit(region_num, dev->mirror_queued)) {
+        vblock_range_unlock(dev, &range);
+        return;
+    }
+    
+    page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+    if (page) {
+        lock_page(page);
+        vblock_zap_page(dev, pos >> PAGE_SHIFT);
+    }
+    // A corrupt compressed page fails the checksum below
+    vblock_read_span(dev, &dev->pages, pos, dev->mirror_buf, dev->region_size);
+    if (page)
+        unlock_page(page);
+    
+    csum = vblock_csum_buf(dev, dev->mirror_buf);
+    if (test_and_clear_bit(region_num, dev->csum_stale)) {
+        dev->csums[region_num] = csum;
+    } else if (csum != dev->csums[region_num]) {
+        // Never spread a corrupted region
+        vblock_range_unlock(dev, &range);
+        vblock_scrub_suspect(dev, region_num);
+        goto done;
+    }
+    
+    for (i = 0; i < dev->nr_mem_replicas; i++) {
+        rep = &dev->replicas[i];
+        if (rep->in_sync &&
+            (vblock_store(&rep->pages, pos, dev->mirror_buf, dev->region_size, GFP_KERNEL) ||
+             vblock_region_csum(dev, &rep->pages, region_num) != csum))
+            vblock_replica_fail(dev, i);
+    }
+    
+    vblock_range_unlock(dev, &range);
+    
+    // File replicas are never read from, so they are written outside the lock
+    for (; i < dev->nr_replicas; i++) {
+        rep = &dev->replicas[i];
+        off = pos;
+        if (rep->in_sync &&
+            kernel_write(rep->file, dev->mirror_buf, dev->region_size, &off) != dev->region_size)
+            vblock_replica_fail(dev, i);
+    }
+
+done:
+    atomic_dec(&dev->mirror_pending);
+    wake_up(&dev->mirror_wait);
+}
+
+static void vblock_mirror_drain(struct vblock_device *dev)
+{
+    unsigned long index;
+    u32 region_num;
+    
+    while (kfifo_get(&dev->mirror_log, &region_num))
+        vblock_mirror_region(dev, region_num);
+    
+    // Regions that did not fit in the log only have their queued bit
+    if (xchg(&dev->mirror_overflow, false)) {
+        for_each_set_bit(index, dev->mirror_queued, dev->total_regions)
+            vblock_mirror_region(dev, index);
+    }
+}
+
+static int vblock_mirror_thread(void *data)
+{
+    struct vblock_device *dev = data;
+    
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(dev->mirror_kick,
+                                 atomic_read(&dev->mirror_pending) || kthread_should_stop());
+        vblock_mirror_drain(dev);
+    }
+    
+    // Writes finished before unload still reach the replicas
+    vblock_mirror_drain(dev);
+    return 0;
+}
+
+static void vblock_mirror_exit(struct vblock_device *dev)
+{
+    unsigned int i;
+    
+    if (dev->mirror_thread)
+        kthread_stop(dev->mirror_thread);
+    
+    for (i = 0; i < dev->nr_replicas; i++) {
+        vblock_free_pages(&dev->replicas[i].pages);
+        if (dev->replicas[i].file)
+            filp_close(dev->replicas[i].file, NULL);
+    }
+    dev->nr_replicas = 0;
+    dev->nr_mem_replicas = 0;
+    
+    kfifo_free(&dev->mirror_log);
+    kfree(dev->mirror_buf);
+    kvfree(dev->mirror_queued);
+}
+
+/*
+ * Set up mirror_enable memory replicas and one file replica per entry of
+ * mirror_files, and start the mirror thread if there are any.
+ */
+static int vblock_mirror_init(struct vblock_device *dev)
+{
+    struct vblock_replica *rep;
+    unsigned int i, nr_mem;
+    int ret;
+    
+    nr_mem = min_t(unsigned int, max(mirror_enable, 0), VBLOCK_MAX_REPLICAS);
+    for (i = 0; i < nr_mem; i++) {
+        xa_init(&dev->replicas[i].pages);
+        dev->replicas[i].in_sync = true;
+    }
+    dev->nr_replicas = dev->nr_mem_replicas = nr_mem;
+    
+    for (i = 0; i < mirror_file_count && dev->nr_replicas < VBLOCK_MAX_REPLICAS; i++) {
+        rep = &dev->replicas[dev->nr_replicas];
+        // The scrubber reads file replicas back to repair from them
+        rep->file = filp_open(mirror_files[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (IS_ERR(rep->file)) {
+            pr_err("Failed to open mirror file: %s\n", mirror_files[i]);
+            ret = PTR_ERR(rep->file);
+            rep->file = NULL;
+            goto cleanup;
+        }
+        
+        xa_init(&rep->pages);
+        rep->in_sync = true;
+        dev->nr_replicas++;
+        
+        // The device starts out zeroed, so does the replica
+        ret = vfs_truncate(&rep->file->f_path, dev->size);
+        if (ret)
+            goto cleanup;
+    }
+    
+    if (dev->nr_replicas == 0)
+        return 0;
+    
+    dev->mirror_max_lag = max(mirror_max_lag, 1u);
+    dev->mirror_queued = kvcalloc(BITS_TO_LONGS(dev->total_regions), sizeof(unsigned long),
+                                  GFP_KERNEL);
+    dev->mirror_buf = kmalloc(dev->region_size, GFP_KERNEL);
+    if (!dev->mirror_queued || !dev->mirror_buf ||
+        kfifo_alloc(&dev->mirror_log, min(dev->mirror_max_lag, dev->total_regions),
+                    GFP_KERNEL)) {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+    
+    spin_lock_init(&dev->mirror_log_lock);
+    atomic_set(&dev->mirror_pending, 0);
+    init_waitqueue_head(&dev->mirror_kick);
+    init_waitqueue_head(&dev->mirror_wait);
+    
+    dev->mirror_thread = kthread_run(vblock_mirror_thread, dev, "vblock_mirror");
+    if (IS_ERR(dev->mirror_thread)) {
+        ret = PTR_ERR(dev->mirror_thread);
+        dev->mirror_thread = NULL;
+        goto cleanup;
+    }
+    
+    pr_info("Mirroring to %u replicas, %u in memory\n", dev->nr_replicas, dev->nr_mem_replicas);
+    return 0;
+
+cleanup:
+    vblock_mirror_exit(dev);
+    return ret;
+}
+
+/**********************************************************************************
+* Helper Functions.
+**********************************************************************************/
+static int parse_write_data(const char *buffer, size_t count, 
+                           loff_t *offset, int *key)
+{
+    char *kernel_buf, *ptr, *token;
+    int ret = 0;
+    bool key_provided = false;
+    
+    kernel_buf = kmalloc(count + 1, GFP_KERNEL);
+    if (!kernel_buf)
+        return -ENOMEM;
+    
+    // Copy and null-terminate
+    memcpy(kernel_buf, buffer, count);
+    kernel_buf[count] = '\0';
+    
+    // Check for key:offset:data format
+    ptr = kernel_buf;
+    token = strsep(&ptr, ":");
+    
+    // Try to parse key
+    if (kstrtoint(token, 10, key) == 0) {
+        key_provided = true;
+        
+        // Get offset
+        token = strsep(&ptr, ":");
+        if (!token) {
+            kfree(kernel_buf);
+            return -EINVAL;
+        }
+        
+        if (kstrtoll(token, 10, offset) != 0) {
+            kfree(kernel_buf);
+            return -EINVAL;
+        }
+    } else {
+        // No key provided, entire string is offset
+        if (kstrtoll(kernel_buf, 10, offset) != 0) {
+            kfree(kernel_buf);
+            return -EINVAL;
+        }
+        *key = 0;
+    }
+    
+    kfree(kernel_buf);
+    return key_provided ? 1 : 0;
+}
+
+// The key table is filled once at init and only read afterwards
+static bool is_valid_key(struct vblock_device *dev, int key)
+{
+    struct vblock_key *k;
+    
+    hash_for_each_possible(dev->keys, k, node, key) {
+        if (k->key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called with the span being written locked
+static int check_region_key(struct vblock_device *dev,
+                            unsigned int region_num, int key_status, int key)
+{
+    if (!region_locked(dev, region_num))
+        return 0;
+    
+    if (key_status != 1 || !is_valid_key(dev, key))
+        return -EACCES;
+    
+    // Check if key matches region's lock key
+    if (key != region_lock_key(region_num))
+        return -EPERM;
+    
+    return 0;
+}
+
+// Locked regions can be written through a file that unlocked them
+static inline bool vblock_file_may_write(struct vblock_file *vf, unsigned int region_num)
+{
+    return !region_locked(vf->dev, region_num) ||
+           (vf->unlocked && test_bit(region_num, vf->unlocked));
+}
+
+/*
+ * Unlock a set of regions for this file. Every key follows the rules of a
+ * keyed ASCII write and stays valid if its region is locked later. Nothing
+ * is unlocked unless all keys are good.
+ */
+static int vblock_file_unlock(struct vblock_file *vf, const struct region_key *keys,
+                              unsigned int count)
+{
+    struct vblock_device *dev = vf->dev;
+    unsigned long *unlocked;
+    unsigned int i;
+    
+    for (i = 0; i < count; i++) {
+        if (!region_valid(dev, keys[i].region_num))
+            return -EINVAL;
+        
+        if (!is_valid_key(dev, keys[i].key))
+            return -EACCES;
+        
+        if (keys[i].key != region_lock_key(keys[i].region_num))
+            return -EPERM;
+    }
+    
+    if (!vf->unlocked) {
+        unlocked = bitmap_zalloc(dev->total_regions, GFP_KERNEL);
+        if (!unlocked)
+            return -ENOMEM;
+        
+        // Another thread sharing the file may have won the race
+        if (cmpxchg(&vf->unlocked, NULL, unlocked))
+            bitmap_free(unlocked);
+    }
+    
+    for (i = 0; i < count; i++)
+        set_bit(keys[i].region_num, vf->unlocked);
+    
+    return 0;
+}
+
+static int vblock_auth_regions(struct vblock_file *vf, struct vblock_auth __user *uauth)
+{
+    struct vblock_auth auth;
+    struct region_key *keys;
+    int ret;
+    
+    if (copy_from_user(&auth, uauth, sizeof(auth)))
+        return -EFAULT;
+    
+    if (auth.count == 0)
+        return 0;
+    
+    if (auth.count > vf->dev->total_regions)
+        return -E2BIG;
+    
+    keys = kvmalloc_array(auth.count, sizeof(*keys), GFP_KERNEL);
+    if (!keys)
+        return -ENOMEM;
+    
+    if (copy_from_user(keys, u64_to_user_ptr(auth.entries), auth.count * sizeof(*keys)))
+        ret = -EFAULT;
+    else
+        ret = vblock_file_unlock(vf, keys, auth.count);
+    
+    kvfree(keys);
+    return ret;
+}
+
+/*
+ * Fill a struct vblock_info_v2 without taking any lock a writer holds: the
+ * lock bitmap is read under the lock_seq seqlock and reread if a region
+ * was locked or unlocked meanwhile.
+ */
+static int vblock_get_info_v2(struct vblock_device *dev, struct vblock_info_v2 __user *uinfo)
+{
+    struct vblock_info_v2 info;
+    unsigned int words = DIV_ROUND_UP(dev->total_regions, 64);
+    unsigned int copy, nbits, seq;
+    u64 *buf = NULL;
+    int ret = 0;
+    
+    if (copy_from_user(&info, uinfo, sizeof(info)))
+        return -EFAULT;
+    
+    copy = min(info.bitmap_words, words);
+    nbits = min_t(u64, dev->total_regions, (u64)copy * 64);
+    if (copy && (info.lock_bitmap || info.dirty_bitmap)) {
+        buf = kvmalloc_array(copy, sizeof(u64), GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+    }
+    
+    do {
+        seq = read_seqbegin(&dev->lock_seq);
+        info.lock_seq = seq;
+        info.nr_locked = bitmap_weight(dev->locked, dev->total_regions);
+        if (buf && info.lock_bitmap)
+            bitmap_to_arr64(buf, dev->locked, nbits);
+    } while (read_seqretry(&dev->lock_seq, seq));
+    
+    if (buf && info.lock_bitmap &&
+        copy_to_user(u64_to_user_ptr(info.lock_bitmap), buf, copy * sizeof(u64))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    
+    info.nr_dirty = bitmap_weight(dev->dirty, dev->total_regions);
+    if (buf && info.dirty_bitmap) {
+        bitmap_to_arr64(buf, dev->dirty, nbits);
+        if (copy_to_user(u64_to_user_ptr(info.dirty_bitmap), buf, copy * sizeof(u64))) {
+            ret = -EFAULT;
+            goto out;
+        }
+    }
+    
+    info.bitmap_words = words;
+    info.total_regions = dev->total_regions;
+    info.region_size = dev->region_size;
+    info.key_count = dev->key_count;
+    info.nr_replicas = dev->nr_replicas;
+    info.mirror_pending = atomic_read(&dev->mirror_pending);
+    info.snap_gen = READ_ONCE(dev->snap_gen);
+    info.reserved = 0;
+    
+    if (copy_to_user(uinfo, &info, sizeof(info)))
+        ret = -EFAULT;
+
+out:
+    kvfree(buf);
+    return ret;
+}
+
+/**********************************************************************************
+* Batched I/O.
+**********************************************************************************/
+// Order by region, keeping submission order within a region
+static int vblock_io_cmp(const void *a, const void *b)
+{
+    const struct vblock_io *x = *(const struct vblock_io **)a;
+    const struct vblock_io *y = *(const struct vblock_io **)b;
+    
+    if (x->region_num != y->region_num)
+        return x->region_num < y->region_num ? -1 : 1;
+    
+    return x < y ? -1 : (x > y);
+}
+
+static int vblock_batch_one(struct vblock_file *vf, struct vblock_io *io)
+{
+    struct vblock_device *dev = vf->dev;
+    u64 pos = region_pos(dev, io->region_num) + io->offset;
+    struct xarray *pages;
+    int ret;
+    
+    switch (io->op) {
+        case VBLOCK_OP_READ:
+            pages = vblock_read_pages(dev, io->region_num);
+            if (!pages)
+                return -EIO;
+            ret = vblock_read_span_user(dev, pages, pos, u64_to_user_ptr(io->buf), io->len);
+            if (!ret)
+                vblock_stat_io(dev, io->region_num, false, io->len);
+            return ret;
+            
+        case VBLOCK_OP_WRITE:
+            if (!vblock_file_may_write(vf, io->region_num))
+                return -EACCES;
+            ret = vblock_write_span_user(dev, pos, u64_to_user_ptr(io->buf), io->len);
+            if (!ret)
+                vblock_stat_io(dev, io->region_num, true, io->len);
+            return ret;
+            
+        case VBLOCK_OP_ERASE:
+            if (!vblock_file_may_write(vf, io->region_num))
+                return -EACCES;
+            return vblock_discard(dev, pos, io->len, true, GFP_KERNEL);
+    }
+    
+    return -EINVAL;
+}
+
+/*
+ * Run a whole array of read/write/erase descriptors in one call. Entries
+ * are processed region by region in ascending order and each region is
+ * locked once for all of its entries, shared if they only read. Only one
+ * region is locked at a time.
+ */
+static int vblock_submit_batch(struct vblock_file *vf, struct vblock_batch __user *ubatch)
+{
+    struct vblock_device *dev = vf->dev;
+    struct vblock_batch batch;
+    struct vblock_io *ios, **order, *io;
+    struct vblock_range range;
+    unsigned int i, j, k, region_num;
+    bool exclusive, valid;
+    int ret = 0;
+    
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    
+    if (batch.count == 0)
+        return 0;
+    
+    if (batch.count > VBLOCK_BATCH_MAX)
+        return -E2BIG;
+    
+    ios = kvmalloc_array(batch.count, sizeof(*ios), GFP_KERNEL);
+    order = kvmalloc_array(batch.count, sizeof(*order), GFP_KERNEL);
+    if (!ios || !order) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    if (copy_from_user(ios, u64_to_user_ptr(batch.entries), batch.count * sizeof(*ios))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    
+    for (i = 0; i < batch.count; i++) {
+        ios[i].status = 0;
+        if (ios[i].op > VBLOCK_OP_ERASE || ios[i].region_num >= dev->total_regions ||
+            ios[i].offset >= dev->region_size || ios[i].len > dev->region_size - ios[i].offset)
+            ios[i].status = -EINVAL;
+        order[i] = &ios[i];
+    }
+    
+    sort(order, batch.count, sizeof(*order), vblock_io_cmp, NULL);
+    
+    for (i = 0; i < batch.count; i = j) {
+        // Entries [i, j) target the same region
+        exclusive = false;
+        valid = false;
+        for (j = i; j < batch.count && order[j]->region_num == order[i]->region_num; j++) {
+            if (order[j]->status)
+                continue;
+            valid = true;
+            if (order[j]->op != VBLOCK_OP_READ)
+                exclusive = true;
+        }
+        
+        if (!valid)
+            continue;
+        
+        region_num = order[i]->region_num;
+        for (k = i; k < j; ) {
+            if (exclusive ? vblock_write_lock(dev, &range, region_pos(dev, region_num),
+                                              dev->region_size, true) :
+                            region_lock(dev, &range, region_num, false, true)) {
+                ret = -ERESTARTSYS;
+                i = k;
+                goto interrupted;
+            }
+            
+            for (; k < j; k++) {
+                if (order[k]->status)
+                    continue;
+                order[k]->status = vblock_batch_one(vf, order[k]);
+                if (order[k]->status == -EFAULT)
+                    break;
+            }
+            
+            if (exclusive)
+                vblock_write_unlock(dev, &range);
+            else
+                vblock_range_unlock(dev, &range);
+            
+            // Copies do not fault: fault the buffer in with nothing locked and retry
+            if (k < j) {
+                io = order[k];
+                if (io->op == VBLOCK_OP_READ ?
+                    fault_in_writeable(u64_to_user_ptr(io->buf), io->len) :
+                    fault_in_readable(u64_to_user_ptr(io->buf), io->len))
+                    k++;
+                else
+                    io->status = 0;
+            }
+        }
+    }
+
+interrupted:
+    // Entries never reached carry the interruption
+    for (; i < batch.count; i++) {
+        if (!order[i]->status)
+            order[i]->status = -EINTR;
+    }
+    
+    if (copy_to_user(u64_to_user_ptr(batch.entries), ios, batch.count * sizeof(*ios)))
+        ret = -EFAULT;
+
+out:
+    kvfree(order);
+    kvfree(ios);
+    return ret;
+}
+
+/**********************************************************************************
+* Checksums and Scrubbing.
+**********************************************************************************/
+/*
+ * Rewrite a corrupted primary region from the first replica holding a copy
+ * that matches its checksum. Called with the whole region locked exclusively
+ * while it is not queued for the mirror, so the replicas are current.
+ */
+static int vblock_scrub_repair(struct vblock_device *dev, unsigned int region_num)
+{
+    u64 pos = region_pos(dev, region_num);
+    struct vblock_replica *rep;
+    unsigned int i;
+    loff_t off;
+    
+    for (i = 0; i < dev->nr_replicas; i++) {
+        rep = &dev->replicas[i];
+        if (!READ_ONCE(rep->in_sync))
+            continue;
+        
+        if (rep->file) {
+            off = pos;
+            if (kernel_read(rep->file, dev->scrub_buf, dev->region_size, &off) != dev->region_size)
+                continue;
+        } else {
+            vblock_load(&rep->pages, pos, dev->scrub_buf, dev->region_size);
+        }
+        
+        if (vblock_csum_buf(dev, dev->scrub_buf) != dev->csums[region_num])
+            continue;
+        
+        // A corrupt compressed page is dropped for the good copy
+        if (vblock_zrestore(dev, pos >> PAGE_SHIFT, GFP_KERNEL) == -EIO)
+            vblock_free_page(dev, pos >> PAGE_SHIFT);
+        
+        if (vblock_store(&dev->pages, pos, dev->scrub_buf, dev->region_size, GFP_KERNEL))
+            return -ENOMEM;
+        
+        vblock_mark_dirty(dev, region_num);
+        return 0;
+    }
+    
+    return -EIO;
+}
+
+static bool vblock_scrub_clean(struct vblock_device *dev, unsigned int region_num)
+{
+    unsigned int i;
+    
+    if (test_bit(region_num, dev->csum_stale) || !vblock_csum_ok(dev, &dev->pages, region_num))
+        return false;
+    
+    if (dev->nr_replicas && test_bit(region_num, dev->mirror_queued))
+        return true;
+    
+    for (i = 0; i < dev->nr_mem_replicas; i++) {
+        if (READ_ONCE(dev->replicas[i].in_sync) &&
+            !vblock_csum_ok(dev, &dev->replicas[i].pages, region_num))
+            return false;
+    }
+    
+    return true;
+}
+
+/*
+ * Check a region and its memory replicas. The common clean case only locks
+ * the region shared; anything else is redone with the region locked
+ * exclusively. A stale checksum is recomputed with the page locked and unmapped,
+ * a bad primary is repaired from the mirror and a bad replica is logged for
+ * the mirror to copy again.
+ */
+static void vblock_scrub_region(struct vblock_device *dev, unsigned int region_num)
+{
+    u64 pos = region_pos(dev, region_num);
+    struct vblock_range range;
+    struct page *page;
+    bool clean;
+    
+    region_lock(dev, &range, region_num, false, false);
+    clean = vblock_scrub_clean(dev, region_num);
+    vblock_range_unlock(dev, &range);
+    
+    if (clean)
+        return;
+    
+    region_lock(dev, &range, region_num, true, false);
+    
+    if (test_and_clear_bit(region_num, dev->csum_stale)) {
+        page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+        if (page) {
+            lock_page(page);
+            vblock_zap_page(dev, pos >> PAGE_SHIFT);
+        }
+        dev->csums[region_num] = vblock_region_csum(dev, &dev->pages, region_num);
+        if (page)
+            unlock_page(page);
+    }
+    
+    if (vblock_scrub_clean(dev, region_num))
+        goto out;
+    
+    if (vblock_region_csum(dev, &dev->pages, region_num) != dev->csums[region_num]) {
+        if (!dev->nr_replicas || test_bit(region_num, dev->mirror_queued) ||
+            vblock_scrub_repair(dev, region_num)) {
+            pr_err_ratelimited("Region %u is corrupted and has no good copy\n", region_num);
+            goto out;
+        }
+        pr_warn("Region %u repaired from the mirror\n", region_num);
+    }
+    
+    // Whatever replica is bad gets the primary copied over it
+    vblock_mirror_queue(dev, region_num);
+
+out:
+    vblock_range_unlock(dev, &range);
+}
+
+// A scrubber idling at scrub_rate 0 sleeps until the rate is set
+static int vblock_scrub_rate_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_uint(val, kp);
+    
+    if (!ret)
+        wake_up(&scrub_rate_wait);
+    return ret;
+}
+
+/*
+ * Walks the allocated pages at scrub_rate regions per second, regions that
+ * failed a read check first. Runs at the lowest priority and locks one
+ * region at a time, so foreground I/O is never held up for long. Each tick
+ * earns scrub_rate * tick regions' worth of credit in ms, so rates below
+ * one region per tick are kept too.
+ */
+static int vblock_scrub_thread(void *data)
+{
+    struct vblock_device *dev = data;
+    unsigned int cursor = 0, first, rate;
+    unsigned long index, zindex;
+    u64 credit = 0, budget;
+    bool found;
+    
+    set_user_nice(current, MAX_NICE);
+    
+    while (!kthread_should_stop()) {
+        rate = READ_ONCE(scrub_rate);
+        if (!rate) {
+            credit = 0;
+            wait_event_interruptible(scrub_rate_wait,
+                                     READ_ONCE(scrub_rate) || kthread_should_stop());
+            continue;
+        }
+        
+        credit += (u64)rate * VBLOCK_SCRUB_TICK_MS;
+        budget = div_u64(credit, MSEC_PER_SEC);
+        credit -= budget * MSEC_PER_SEC;
+        
+        while (budget > 0) {
+            index = find_first_bit(dev->scrub_suspect, dev->total_regions);
+            if (index >= dev->total_regions)
+                break;
+            
+            clear_bit(index, dev->scrub_suspect);
+            vblock_scrub_region(dev, index);
+            budget--;
+        }
+        
+        while (budget > 0) {
+            // Holes cannot go bad, move on to the next allocated or compressed page
+            index = zindex = region_pos(dev, cursor) >> PAGE_SHIFT;
+            found = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT);
+            if (xa_find(&dev->zpages, &zindex, ULONG_MAX, XA_PRESENT) &&
+                (!found || zindex < index)) {
+                index = zindex;
+                found = true;
+            }
+            
+            if (!found) {
+                pr_debug("Scrub pass completed\n");
+                cursor = 0;
+                break;
+            }
+            
+            page_regions(dev, index, &first);
+            cursor = max(cursor, first);
+            
+            vblock_scrub_region(dev, cursor);
+            budget--;
+            
+            if (++cursor >= dev->total_regions)
+                cursor = 0;
+        }
+        
+        schedule_timeout_interruptible(msecs_to_jiffies(VBLOCK_SCRUB_TICK_MS));
+    }
+    
+    return 0;
+}
+
+static void vblock_csum_exit(struct vblock_device *dev)
+{
+    if (dev->scrub_thread)
+        kthread_stop(dev->scrub_thread);
+    
+    kvfree(dev->scrub_suspect);
+    kvfree(dev->csum_stale);
+    kvfree(dev->csums);
+    kfree(dev->scrub_buf);
+    if (!IS_ERR_OR_NULL(dev->csum_tfm))
+        crypto_free_shash(dev->csum_tfm);
+}
+
+// Every region starts out zeroed, with the checksum of a zeroed region
+static int vblock_csum_init(struct vblock_device *dev)
+{
+    dev->csum_tfm = crypto_alloc_shash("crc32c", 0, 0);
+    if (IS_ERR(dev->csum_tfm)) {
+        pr_err("Failed to allocate crc32c transform\n");
+        return PTR_ERR(dev->csum_tfm);
+    }
+    pr_info("Region checksums use %s\n", crypto_shash_driver_name(dev->csum_tfm));
+    
+    dev->scrub_buf = kzalloc(dev->region_size, GFP_KERNEL);
+    dev->csums = kvmalloc_array(dev->total_regions, sizeof(u32), GFP_KERNEL);
+    dev->csum_stale = kvcalloc(BITS_TO_LONGS(dev->total_regions), sizeof(unsigned long),
+                               GFP_KERNEL);
+    dev->scrub_suspect = kvcalloc(BITS_TO_LONGS(dev->total_regions), sizeof(unsigned long),
+                                  GFP_KERNEL);
+    if (!dev->scrub_buf || !dev->csums || !dev->csum_stale || !dev->scrub_suspect) {
+        vblock_csum_exit(dev);
+        return -ENOMEM;
+    }
+    
+    dev->zero_csum = vblock_csum_buf(dev, dev->scrub_buf);
+    memset32(dev->csums, dev->zero_csum, dev->total_regions);
+    return 0;
+}
+
+/**********************************************************************************
+* Image Persistence.
+**********************************************************************************/
+struct vblock_load_work {
+    struct work_struct work;
+    struct vblock_device *dev;
+    u64 start;
+    u64 end;
+    int ret;
+};
+
+/*
+ * Load one chunk of the image page by page. All-zero pages stay holes, the
+ * others get their checksums and are logged for the mirror, whose file
+ * replicas start out empty.
+ */
+static void vblock_load_chunk(struct work_struct *work)
+{
+    struct vblock_load_work *lw = container_of(work, struct vblock_load_work, work);
+    struct vblock_device *dev = lw->dev;
+    unsigned int first, nr, region_num;
+    void *buffer;
+    loff_t pos;
+    ssize_t got;
+    u64 off;
+    
+    buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buffer) {
+        lw->ret = -ENOMEM;
+        return;
+    }
+    
+    for (off = lw->start; off < lw->end; off += PAGE_SIZE) {
+        memset(buffer, 0, PAGE_SIZE);
+        pos = off;
+        got = kernel_read(dev->image, buffer, min_t(u64, PAGE_SIZE, lw->end - off), &pos);
+        if (got < 0) {
+            lw->ret = got;
+            break;
+        }
+        
+        if (!memchr_inv(buffer, 0, PAGE_SIZE))
+            continue;
+        
+        lw->ret = vblock_store(&dev->pages, off, buffer, PAGE_SIZE, GFP_KERNEL);
+        if (lw->ret)
+            break;
+        
+        nr = page_regions(dev, off >> PAGE_SHIFT, &first);
+        for (region_num = first; region_num < first + nr; region_num++) {
+            dev->csums[region_num] = vblock_region_csum(dev, &dev->pages, region_num);
+            vblock_mirror_queue(dev, region_num);
+        }
+    }
+    
+    kfree(buffer);
+}
+
+// Read the image into the empty device, one work item per chunk
+static int vblock_image_load(struct vblock_device *dev)
+{
+    struct vblock_load_work *works;
+    unsigned int i, nr_works;
+    u64 size;
+    int ret = 0;
+    
+    size = i_size_read(file_inode(dev->image));
+    if (size > dev->size) {
+        pr_warn("Image is larger than the device, loading the first %llu bytes\n", dev->size);
+        size = dev->size;
+    }
+    
+    if (size == 0)
+        return 0;
+    
+    nr_works = DIV_ROUND_UP(size, VBLOCK_LOAD_CHUNK);
+    works = kvcalloc(nr_works, sizeof(*works), GFP_KERNEL);
+    if (!works)
+        return -ENOMEM;
+    
+    for (i = 0; i < nr_works; i++) {
+        INIT_WORK(&works[i].work, vblock_load_chunk);
+        works[i].dev = dev;
+        works[i].start = (u64)i * VBLOCK_LOAD_CHUNK;
+        works[i].end = min_t(u64, works[i].start + VBLOCK_LOAD_CHUNK, size);
+        queue_work(system_unbound_wq, &works[i].work);
+    }
+    
+    for (i = 0; i < nr_works; i++) {
+        flush_work(&works[i].work);
+        if (works[i].ret && !ret)
+            ret = works[i].ret;
+    }
+    
+    kvfree(works);
+    
+    if (ret == 0)
+        pr_info("Loaded %llu bytes from %s\n", size, image_path);
+    return ret;
+}
+
+// Write one run of regions back, marking it dirty again if that fails
+static int vblock_wb_flush(struct vblock_device *dev, loff_t pos, size_t len)
+{
+    loff_t off = pos;
+    ssize_t written;
+    unsigned int region_num;
+    
+    if (len == 0)
+        return 0;
+    
+    written = kernel_write(dev->image, dev->wb_buf, len, &off);
+    if (written == len)
+        return 0;
+    
+    for (region_num = pos / dev->region_size; len > 0; region_num++, len -= dev->region_size)
+        set_bit(region_num, dev->wb_dirty);
+    
+    return written < 0 ? written : -EIO;
+}
+
+/*
+ * Write every dirty region back to the image in offset order. Adjacent
+ * regions, also across pages, are gathered into wb_buf and written with
+ * one call. Pages are zapped before their regions are copied, so a write
+ * through a mapping after that marks them dirty again.
+ */
+static int vblock_writeback(struct vblock_device *dev)
+{
+    DECLARE_BITMAP(mask, PAGE_SIZE / SECTOR_SIZE);
+    struct vblock_range range;
+    unsigned int region_num, first, nr, i;
+    loff_t run_pos = 0;
+    size_t run_len = 0;
+    u64 pos;
+    int err, ret = 0;
+    
+    region_num = find_first_bit(dev->wb_dirty, dev->total_regions);
+    while (region_num < dev->total_regions) {
+        nr = page_regions(dev, region_pos(dev, region_num) >> PAGE_SHIFT, &first);
+        
+        bitmap_zero(mask, nr);
+        for (i = 0; i < nr; i++) {
+            if (test_and_clear_bit(first + i, dev->wb_dirty))
+                __set_bit(i, mask);
+        }
+        
+        if (!bitmap_empty(mask, nr))
+            vblock_zap_page(dev, region_pos(dev, first) >> PAGE_SHIFT);
+        
+        for_each_set_bit(i, mask, nr) {
+            pos = region_pos(dev, first + i);
+            
+            // Start a new run after a gap or once the buffer is full
+            if (run_len && (pos != run_pos + run_len ||
+                            run_len + dev->region_size > VBLOCK_WB_BUF_SIZE)) {
+                err = vblock_wb_flush(dev, run_pos, run_len);
+                if (err && !ret)
+                    ret = err;
+                run_len = 0;
+            }
+            
+            if (run_len == 0)
+                run_pos = pos;
+            
+            region_lock(dev, &range, first + i, false, false);
+            err = vblock_read_span(dev, &dev->pages, pos, dev->wb_buf + run_len,
+                                   dev->region_size);
+            vblock_range_unlock(dev, &range);
+            
+            // Keep the region dirty rather than write back zeroes
+            if (err) {
+                set_bit(first + i, dev->wb_dirty);
+                if (!ret)
+                    ret = err;
+                continue;
+            }
+            
+            run_len += dev->region_size;
+        }
+        
+        region_num = find_next_bit(dev->wb_dirty, dev->total_regions, first + nr);
+    }
+    
+    err = vblock_wb_flush(dev, run_pos, run_len);
+    return ret ? ret : err;
+}
+
+/*
+ * Writes back every writeback_interval_ms and fsyncs the image after a
+ * write-back once fsync_interval_ms have passed since the last fsync. Stops
+ * after a last write-back and fsync.
+ */
+static int vblock_wb_thread(void *data)
+{
+    struct vblock_device *dev = data;
+    unsigned long last_sync = jiffies;
+    bool unsynced = false;
+    int ret;
+    
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(writeback_interval_ms));
+        
+        if (find_first_bit(dev->wb_dirty, dev->total_regions) < dev->total_regions) {
+            ret = vblock_writeback(dev);
+            if (ret)
+                pr_err_ratelimited("Write-back to %s failed: %d\n", image_path, ret);
+            unsynced = true;
+        }
+        
+        if (unsynced &&
+            time_after_eq(jiffies, last_sync + msecs_to_jiffies(fsync_interval_ms))) {
+            vfs_fsync(dev->image, 0);
+            last_sync = jiffies;
+            unsynced = false;
+        }
+    }
+    
+    ret = vblock_writeback(dev);
+    if (ret)
+        pr_err("Final write-back to %s failed: %d\n", image_path, ret);
+    vfs_fsync(dev->image, 0);
+    return 0;
+}
+
+static void vblock_image_exit(struct vblock_device *dev)
+{
+    if (dev->wb_thread)
+        kthread_stop(dev->wb_thread);
+    
+    if (dev->image)
+        filp_close(dev->image, NULL);
+    dev->image = NULL;
+    kfree(dev->wb_buf);
+    kvfree(dev->wb_dirty);
+    dev->wb_dirty = NULL;
+}
+
+/*
+ * Open image_path, load it and start the write-back thread. The image is
+ * extended to the device size, a larger one keeps its tail untouched.
+ */
+static int vblock_image_init(struct vblock_device *dev)
+{
+    int ret;
+    
+    if (!image_path)
+        return 0;
+    
+    dev->image = filp_open(image_path, O_RDWR | O_CREAT, 0644);
+    if (IS_ERR(dev->image)) {
+        pr_err("Failed to open image: %s\n", image_path);
+        ret = PTR_ERR(dev->image);
+        dev->image = NULL;
+        return ret;
+    }
+    
+    dev->wb_buf = kmalloc(VBLOCK_WB_BUF_SIZE, GFP_KERNEL);
+    dev->wb_dirty = kvcalloc(BITS_TO_LONGS(dev->total_regions), sizeof(unsigned long),
+                             GFP_KERNEL);
+    if (!dev->wb_buf || !dev->wb_dirty) {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+    
+    ret = vblock_image_load(dev);
+    if (ret) {
+        pr_err("Failed to load image: %s\n", image_path);
+        goto cleanup;
+    }
+    
+    if (i_size_read(file_inode(dev->image)) < dev->size) {
+        ret = vfs_truncate(&dev->image->f_path, dev->size);
+        if (ret)
+            goto cleanup;
+    }
+    
+    dev->wb_thread = kthread_run(vblock_wb_thread, dev, "vblock_wb");
+    if (IS_ERR(dev->wb_thread)) {
+        ret = PTR_ERR(dev->wb_thread);
+        dev->wb_thread = NULL;
+        goto cleanup;
+    }
+    
+    return 0;
+
+cleanup:
+    vblock_image_exit(dev);
+    return ret;
+}
+
+/**********************************************************************************
+* Snapshots.
+**********************************************************************************/
+/*
+ * Snapshot n sees a region as the copy in the oldest snapshot taken since
+ * n that has one, or as the live region if nobody wrote it since. Called
+ * with snap_sem held for read and the span locked shared.
+ */
+static int vblock_snap_load_user(struct vblock_device *dev, struct vblock_snapshot *snap,
+                                 u64 pos, char __user *dst, size_t len)
+{
+    unsigned int region_num = pos / dev->region_size;
+    char *copy = NULL;
+    
+    list_for_each_entry_from(snap, &dev->snapshots, list) {
+        copy = xa_load(&snap->regions, region_num);
+        if (copy)
+            break;
+    }
+    
+    if (!copy)
+        return vblock_read_span_user(dev, &dev->pages, pos, dst, len);
+    
+    return copy_to_user_nofault(dst, copy + pos % dev->region_size, len);
+}
+
+static void vblock_snapshot_release(struct kref *ref)
+{
+    kfree(container_of(ref, struct vblock_snapshot, ref));
+}
+
+// Returns the new snapshot's number or a negative error
+static int vblock_snapshot_create(struct vblock_device *dev)
+{
+    struct vblock_snapshot *snap;
+    unsigned int slot;
+    int ret;
+    
+    mutex_lock(&dev->snap_mutex);
+    
+    for (slot = 0; slot < VBLOCK_MAX_SNAPSHOTS && dev->snaps[slot]; slot++)
+        ;
+    if (slot == VBLOCK_MAX_SNAPSHOTS) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    snap->slot = slot;
+    xa_init(&snap->regions);
+    kref_init(&snap->ref);
+    
+    snap->device = device_create(dev->class, NULL, dev->dev_no + slot + 1, NULL,
+                                 "%s_snap%u", DEVICE_NAME, slot);
+    if (IS_ERR(snap->device)) {
+        ret = PTR_ERR(snap->device);
+        kfree(snap);
+        goto out;
+    }
+    
+    // Waits for writes in flight, later ones copy before they change a region
+    percpu_down_write(&dev->snap_sem);
+    snap->gen = ++dev->snap_gen;
+    list_add_tail(&snap->list, &dev->snapshots);
+    
+    // Writes through mappings must fault into page_mkwrite again
+    if (dev->inode)
+        unmap_mapping_range(dev->inode->i_mapping, 0, 0, 0);
+    percpu_up_write(&dev->snap_sem);
+    
+    dev->snaps[slot] = snap;
+    ret = slot;
+    pr_debug("Snapshot %u taken at generation %u\n", slot, snap->gen);
+
+out:
+    mutex_unlock(&dev->snap_mutex);
+    return ret;
+}
+
+/*
+ * The next older snapshot shares every copy it lacks with this one, as the
+ * region was not written between the two, so those copies move to it.
+ * Called with snap_sem held for write.
+ */
+static int vblock_snapshot_unlink(struct vblock_device *dev, struct vblock_snapshot *snap)
+{
+    struct vblock_snapshot *prev = NULL;
+    unsigned long index;
+    void *copy;
+    int ret = 0;
+    
+    if (!list_is_first(&snap->list, &dev->snapshots))
+        prev = list_prev_entry(snap, list);
+    
+    xa_for_each(&snap->regions, index, copy) {
+        if (prev && !xa_load(&prev->regions, index) &&
+            xa_is_err(xa_store(&prev->regions, index, copy, GFP_KERNEL))) {
+            ret = -ENOMEM;
+            break;
+        }
+    }
+    
+    xa_for_each(&snap->regions, index, copy) {
+        if (prev && xa_load(&prev->regions, index) == copy) {
+            // Undo the moves if one failed
+            if (ret)
+                xa_erase(&prev->regions, index);
+        } else if (!ret) {
+            kfree(copy);
+        }
+    }
+    
+    if (ret)
+        return ret;
+    
+    xa_destroy(&snap->regions);
+    list_del(&snap->list);
+    snap->deleted = true;
+    return 0;
+}
+
+static int vblock_snapshot_delete(struct vblock_device *dev, int slot)
+{
+    struct vblock_snapshot *snap;
+    int ret;
+    
+    if (slot < 0 || slot >= VBLOCK_MAX_SNAPSHOTS)
+        return -EINVAL;
+    
+    mutex_lock(&dev->snap_mutex);
+    
+    snap = dev->snaps[slot];
+    if (!snap) {
+        ret = -ENOENT;
+        goto out;
+    }
+    
+    percpu_down_write(&dev->snap_sem);
+    ret = vblock_snapshot_unlink(dev, snap);
+    percpu_up_write(&dev->snap_sem);
+    if (ret)
+        goto out;
+    
+    device_destroy(dev->class, dev->dev_no + slot + 1);
+    dev->snaps[slot] = NULL;
+    kref_put(&snap->ref, vblock_snapshot_release);
+    pr_debug("Snapshot %d deleted\n", slot);
+
+out:
+    mutex_unlock(&dev->snap_mutex);
+    return ret;
+}
+
+/**********************************************************************************
+* Memory Mapping.
+**********************************************************************************/
+/*
+ * Mappings see the region pages themselves. A page is allocated on first
+ * fault and mapped read-only until the first write, which goes through
+ * page_mkwrite and is refused if any region in the page is locked and not
+ * unlocked by the mapping file. Locking a region zaps the mappings of its
+ * page so the next write faults again. Protection is per page, so regions
+ * smaller than a page share it. A write through a mapping marks every region
+ * of the page dirty, logs it for the mirror and leaves its checksum stale.
+ */
+/*
+ * Find or allocate the page at index and take a reference, NULL if out of
+ * memory and ERR_PTR(-EAGAIN) if a discard freed it under us. A compressed
+ * page is restored first; the zlock is held until the reference is taken,
+ * since the compressor leaves referenced pages alone.
+ */
+static struct page *vblock_fault_page(struct vblock_device *dev, pgoff_t index)
+{
+    struct page *page = NULL;
+    
+    if (dev->ztfm)
+        mutex_lock(vblock_zlock(dev, index));
+    
+    if ((!dev->ztfm || !vblock_zrestore_locked(dev, index, GFP_KERNEL)) &&
+        vblock_alloc_page(&dev->pages, index, GFP_KERNEL)) {
+        rcu_read_lock();
+        page = xa_load(&dev->pages, index);
+        if (!page || !get_page_unless_zero(page))
+            page = ERR_PTR(-EAGAIN);
+        rcu_read_unlock();
+    }
+    
+    if (dev->ztfm)
+        mutex_unlock(vblock_zlock(dev, index));
+    
+    return page;
+}
+
+static vm_fault_t vblock_vm_fault(struct vm_fault *vmf)
+{
+    struct vblock_file *vf = vmf->vma->vm_file->private_data;
+    struct vblock_device *dev = vf->dev;
+    struct page *page;
+    
+    if ((u64)vmf->pgoff << PAGE_SHIFT >= dev->size)
+        return VM_FAULT_SIGBUS;
+    
+    /*
+     * A discard may free the page under us: take the reference speculatively
+     * and recheck under the page lock. The page is returned locked, so it is
+     * mapped before a discard can drop it.
+     */
+    for (;;) {
+        page = vblock_fault_page(dev, vmf->pgoff);
+        if (!page)
+            return VM_FAULT_OOM;
+        
+        if (IS_ERR(page))
+            continue;
+        
+        lock_page(page);
+        if (xa_load(&dev->pages, vmf->pgoff) == page)
+            break;
+        
+        unlock_page(page);
+        put_page(page);
+    }
+    
+    vmf->page = page;
+    return VM_FAULT_LOCKED;
+}
+
+static vm_fault_t vblock_vm_page_mkwrite(struct vm_fault *vmf)
+{
+    struct vblock_file *vf = vmf->vma->vm_file->private_data;
+    struct vblock_device *dev = vf->dev;
+    struct vblock_range range;
+    unsigned int region_num, first, nr;
+    int ret = 0;
+    
+    nr = page_regions(dev, vmf->pgoff, &first);
+    
+    for (region_num = first; region_num < first + nr; region_num++) {
+        if (!vblock_file_may_write(vf, region_num))
+            return VM_FAULT_SIGBUS;
+    }
+    
+    // Taking a snapshot or mirroring a region zaps the page, so its next write gets here.
+    // A task killed while waiting fails the fault, it is exiting anyway.
+    if (vblock_write_lock(dev, &range, region_pos(dev, first), (u64)nr * dev->region_size,
+                          true))
+        return VM_FAULT_SIGBUS;
+    
+    for (region_num = first; region_num < first + nr && !ret; region_num++) {
+        ret = vblock_cow_region(dev, region_num, GFP_KERNEL);
+        vblock_mirror_queue(dev, region_num);
+        set_bit(region_num, dev->csum_stale);
+    }
+    vblock_write_unlock(dev, &range);
+    
+    if (ret)
+        return VM_FAULT_OOM;
+    
+    // Backup and write-back zap the page before copying, so later writes fault here
+    for (region_num = first; region_num < first + nr; region_num++)
+        vblock_mark_dirty(dev, region_num);
+    
+    lock_page(vmf->page);
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct vblock_vm_ops = {
+    .fault          = vblock_vm_fault,
+    .page_mkwrite   = vblock_vm_page_mkwrite,
+};
+
+// Make the next write to the page through any mapping fault again
+static void vblock_zap_page(struct vblock_device *dev, pgoff_t index)
+{
+    if (dev->inode)
+        unmap_mapping_range(dev->inode->i_mapping, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, 0);
+}
+
+// Called with the whole region locked exclusively after it was locked
+static void vblock_zap_region(struct vblock_device *dev, unsigned int region_num)
+{
+    vblock_zap_page(dev, region_pos(dev, region_num) >> PAGE_SHIFT);
+}
+
+/**********************************************************************************
+* Block Device.
+**********************************************************************************/
+/*
+ * Copy between a kernel buffer and the regions starting at byte pos, with
+ * the whole span locked once. The block layer has no way to carry a key, so
+ * writes to locked regions are refused.
+ */
+static int vblock_rw_kernel(struct vblock_device *dev, void *buf,
+                            loff_t pos, size_t len, bool is_write)
+{
+    struct vblock_range range;
+    unsigned int region_num, region_offset;
+    struct xarray *pages;
+    size_t chunk;
+    int ret = 0;
+    
+    if (pos < 0 || pos + len > dev->size)
+        return -EINVAL;
+    
+    if (len == 0)
+        return 0;
+    
+    if (is_write)
+        vblock_write_lock(dev, &range, pos, len, false);
+    else
+        vblock_read_lock(dev, &range, pos, len, false);
+    
+    region_num = pos / dev->region_size;
+    region_offset = pos % dev->region_size;
+    
+    while (len > 0) {
+        chunk = min_t(size_t, dev->region_size - region_offset, len);
+        
+        if (is_write) {
+            if (region_locked(dev, region_num)) {
+                ret = -EACCES;
+            } else {
+                // No reclaim into the I/O path of this very device
+                ret = vblock_write_span(dev, pos, buf, chunk, GFP_NOIO);
+            }
+        } else {
+            pages = vblock_read_pages(dev, region_num);
+            ret = pages ? vblock_read_span(dev, pages, pos, buf, chunk) : -EIO;
+        }
+        
+        if (ret)
+            break;
+        
+        vblock_stat_io(dev, region_num, is_write, chunk);
+        buf += chunk;
+        pos += chunk;
+        len -= chunk;
+        region_offset = 0;
+        region_num++;
+    }
+    
+    if (is_write)
+        vblock_write_unlock(dev, &range);
+    else
+        vblock_range_unlock(dev, &range);
+    
+    return ret;
+}
+
+// Discard or write zeroes from the block layer, locked regions are refused
+static int vblock_discard_kernel(struct vblock_device *dev, loff_t pos, u64 len, bool unmap)
+{
+    struct vblock_range range;
+    unsigned int region_num;
+    int ret = 0;
+    
+    if (pos < 0 || pos + len > dev->size)
+        return -EINVAL;
+    
+    if (len == 0)
+        return 0;
+    
+    vblock_write_lock(dev, &range, pos, len, false);
+    
+    for (region_num = pos / dev->region_size;
+         region_num <= (pos + len - 1) / dev->region_size; region_num++) {
+        if (region_locked(dev, region_num)) {
+            ret = -EACCES;
+            break;
+        }
+    }
+    
+    if (!ret)
+        ret = vblock_discard(dev, pos, len, unmap, GFP_NOIO);
+    
+    vblock_write_unlock(dev, &range);
+    
+    // Zeroing counts as writing the bytes of each region it covers
+    if (!ret && dev->stats) {
+        for (region_num = pos / dev->region_size;
+             region_num <= (pos + len - 1) / dev->region_size; region_num++)
+            vblock_stat_io(dev, region_num, true,
+                           min_t(u64, region_pos(dev, region_num + 1), pos + len) -
+                           max_t(u64, region_pos(dev, region_num), pos));
+    }
+    
+    return ret;
+}
+
+static blk_status_t vblock_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                    const struct blk_mq_queue_data *bd)
+{
+    struct vblock_device *dev = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    blk_status_t status = BLK_STS_OK;
+    u64 start = vblock_stat_start(dev);
+    void *buf;
+    int err;
+    
+    blk_mq_start_request(rq);
+    
+    switch (req_op(rq)) {
+        case REQ_OP_READ:
+        case REQ_OP_WRITE:
+            rq_for_each_segment(bvec, rq, iter) {
+                buf = bvec_kmap_local(&bvec);
+                err = vblock_rw_kernel(dev, buf, pos, bvec.bv_len,
+                                       req_op(rq) == REQ_OP_WRITE);
+                kunmap_local(buf);
+                
+                // rq_for_each_segment is a nested loop, break would not leave it
+                if (err) {
+                    status = BLK_STS_IOERR;
+                    goto end_request;
+                }
+                
+                pos += bvec.bv_len;
+            }
+            
+            vblock_stat_latency(dev, req_op(rq) == REQ_OP_WRITE ?
+                                VBLOCK_LAT_WRITE : VBLOCK_LAT_READ, start);
+            break;
+            
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+            // Both leave zeroes behind, NOUNMAP asks to keep the memory
+            if (vblock_discard_kernel(dev, pos, blk_rq_bytes(rq),
+                                      !(rq->cmd_flags & REQ_NOUNMAP)))
+                status = BLK_STS_IOERR;
+            vblock_stat_latency(dev, VBLOCK_LAT_WRITE, start);
+            break;
+            
+        case REQ_OP_FLUSH:
+            // Storage is RAM, nothing to flush
+            break;
+            
+        default:
+            status = BLK_STS_NOTSUPP;
+            break;
+    }
+
+end_request:
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+/*
+ * Register the storage as a blk-mq disk with one hardware queue per CPU.
+ * queue_rq sleeps on range locks, hence BLK_MQ_F_BLOCKING.
+ */
+static int vblock_blk_init(struct vblock_device *dev)
+{
+    struct queue_limits lim = {
+        .logical_block_size       = SECTOR_SIZE,
+        .physical_block_size      = dev->region_size,
+        .max_hw_sectors           = BLK_MAX_SECTORS,
+        .max_hw_discard_sectors   = UINT_MAX,
+        .discard_granularity      = PAGE_SIZE,
+        .max_write_zeroes_sectors = UINT_MAX,
+    };
+    int ret;
+    
+    dev->blk_major = register_blkdev(0, BLK_DEVICE_NAME);
+    if (dev->blk_major < 0) {
+        pr_err("Error in block device registration\n");
+        return dev->blk_major;
+    }
+    
+    dev->tag_set.ops = &vblock_mq_ops;
+    dev->tag_set.nr_hw_queues = num_possible_cpus();
+    dev->tag_set.queue_depth = BLK_QUEUE_DEPTH;
+    dev->tag_set.numa_node = NUMA_NO_NODE;
+    dev->tag_set.flags = BLK_MQ_F_BLOCKING;
+    dev->tag_set.driver_data = dev;
+    
+    ret = blk_mq_alloc_tag_set(&dev->tag_set);
+    if (ret) {
+        pr_err("Error in tag set allocation\n");
+        goto cleanup_blkdev;
+    }
+    
+    dev->disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
+    if (IS_ERR(dev->disk)) {
+        pr_err("Error in disk allocation\n");
+        ret = PTR_ERR(dev->disk);
+        goto cleanup_tag_set;
     }
     
-    kfree(kernel_buf);
-    return key_provided ? 1 : 0;
+    dev->disk->major = dev->blk_major;
+    dev->disk->first_minor = 0;
+    dev->disk->minors = 1;
+    dev->disk->fops = &vblock_bd_ops;
+    dev->disk->private_data = dev;
+    snprintf(dev->disk->disk_name, sizeof(dev->disk->disk_name), "%s0", BLK_DEVICE_NAME);
+    set_capacity(dev->disk, dev->size >> SECTOR_SHIFT);
+    
+    ret = add_disk(dev->disk);
+    if (ret) {
+        pr_err("Error in adding disk\n");
+        goto cleanup_disk;
+    }
+    
+    return 0;
+
+cleanup_disk:
+    put_disk(dev->disk);
+cleanup_tag_set:
+    blk_mq_free_tag_set(&dev->tag_set);
+cleanup_blkdev:
+    unregister_blkdev(dev->blk_major, BLK_DEVICE_NAME);
+    
+    return ret;
 }
 
-static bool is_valid_key(struct vblock_device *dev, int key)
+static void vblock_blk_exit(struct vblock_device *dev)
 {
-    int i;
-    
-    for (i = 0; i < dev->key_count; i++) {
-        if (dev->user_keys[i] == key) {
-            return true;
-        }
-    }
-    return false;
+    del_gendisk(dev->disk);
+    put_disk(dev->disk);
+    blk_mq_free_tag_set(&dev->tag_set);
+    unregister_blkdev(dev->blk_major, BLK_DEVICE_NAME);
 }
 
 /**********************************************************************************
@@ -240,9 +3588,17 @@ static bool is_valid_key(struct vblock_device *dev, int key)
 ***********************************************/
 static int __init block_dev_init(void)
 {
-    int i;
+    unsigned int i, nr_locks;
+    
+    pr_info("Initializing vblock storage device\n");
     
-    pr_info("Initializing 4KB Block Storage Device\n");
+    // Validate geometry
+    if (!is_power_of_2(region_size) || region_size < SECTOR_SIZE ||
+        region_size > PAGE_SIZE || total_regions == 0 || total_regions > INT_MAX) {
+        pr_err("Invalid geometry: region_size %u, total_regions %u\n",
+               region_size, total_regions);
+        return -EINVAL;
+    }
     
     vblock_dev = kzalloc(sizeof(struct vblock_device), GFP_KERNEL);
     if (!vblock_dev) {
@@ -250,41 +3606,101 @@ static int __init block_dev_init(void)
         return -ENOMEM;
     }
     
-    // Initialize regions
-    for (i = 0; i < TOTAL_REGIONS; i++) {
-        mutex_init(&vblock_dev->regions[i].region_mutex);
-        sema_init(&vblock_dev->regions[i].read_sem, 1);
-        vblock_dev->regions[i].locked = 0;
-        vblock_dev->regions[i].lock_key = 0;
-        memset(vblock_dev->regions[i].data, 0, REGION_SIZE);
+    vblock_dev->region_size = region_size;
+    vblock_dev->total_regions = total_regions;
+    vblock_dev->size = (u64)region_size * total_regions;
+    xa_init(&vblock_dev->pages);
+    
+    // Range locks, and the stripes guarding per-region metadata
+    vblock_dev->ranges = RB_ROOT_CACHED;
+    spin_lock_init(&vblock_dev->ranges_lock);
+    nr_locks = min_t(unsigned int, roundup_pow_of_two(total_regions), MAX_LOCK_STRIPES);
+    vblock_dev->meta_locks = kcalloc(nr_locks, sizeof(struct mutex), GFP_KERNEL);
+    if (!vblock_dev->meta_locks) {
+        pr_err("Failed to allocate region locks\n");
+        kfree(vblock_dev);
+        return -ENOMEM;
     }
     
-    // Setup mirror buffer if enabled
-    vblock_dev->mirror_enable = mirror_enable;
-    if (mirror_enable) {
-        vblock_dev->mirror_buffer = kzalloc(TOTAL_SIZE, GFP_KERNEL);
-        if (!vblock_dev->mirror_buffer) {
-            pr_err("Failed to allocate mirror buffer\n");
-            kfree(vblock_dev);
-            return -ENOMEM;
-        }
-        pr_info("Mirror mode enabled\n");
+    for (i = 0; i < nr_locks; i++) {
+        mutex_init(&vblock_dev->meta_locks[i]);
+    }
+    vblock_dev->lock_mask = nr_locks - 1;
+    
+    // One dirty bit per region for incremental backups, one lock bit
+    vblock_dev->dirty = kvcalloc(BITS_TO_LONGS(total_regions), sizeof(unsigned long),
+                                 GFP_KERNEL);
+    vblock_dev->locked = kvcalloc(BITS_TO_LONGS(total_regions), sizeof(unsigned long),
+                                  GFP_KERNEL);
+    if (!vblock_dev->dirty || !vblock_dev->locked) {
+        pr_err("Failed to allocate region bitmaps\n");
+        kvfree(vblock_dev->locked);
+        kvfree(vblock_dev->dirty);
+        kfree(vblock_dev->meta_locks);
+        kfree(vblock_dev);
+        return -ENOMEM;
+    }
+    seqlock_init(&vblock_dev->lock_seq);
+    mutex_init(&vblock_dev->backup_mutex);
+    INIT_DELAYED_WORK(&vblock_dev->backup_work, vblock_backup_work);
+    
+    // Snapshot state, generation 0 predates every snapshot
+    vblock_dev->cow_gen = kvcalloc(total_regions, sizeof(u32), GFP_KERNEL);
+    if (!vblock_dev->cow_gen || percpu_init_rwsem(&vblock_dev->snap_sem)) {
+        pr_err("Failed to allocate snapshot state\n");
+        kvfree(vblock_dev->cow_gen);
+        kvfree(vblock_dev->locked);
+        kvfree(vblock_dev->dirty);
+        kfree(vblock_dev->meta_locks);
+        kfree(vblock_dev);
+        return -ENOMEM;
     }
+    INIT_LIST_HEAD(&vblock_dev->snapshots);
+    mutex_init(&vblock_dev->snap_mutex);
     
     // Copy user keys
     vblock_dev->key_count = min(key_count, MAX_KEYS);
+    hash_init(vblock_dev->keys);
     if (vblock_dev->key_count > 0) {
         memcpy(vblock_dev->user_keys, user_keys, 
                vblock_dev->key_count * sizeof(int));
+        for (i = 0; i < vblock_dev->key_count; i++) {
+            vblock_dev->key_nodes[i].key = user_keys[i];
+            hash_add(vblock_dev->keys, &vblock_dev->key_nodes[i].node, user_keys[i]);
+        }
         pr_info("Loaded %d user keys\n", vblock_dev->key_count);
     }
     
-    // Allocate device number
-    if (alloc_chrdev_region(&vblock_dev->dev_no, 0, 1, DEVICE_NUMBER) < 0) {
-        pr_err("Error in device number creation\n");
+    if (vblock_stats_init(vblock_dev) < 0) {
+        goto cleanup_storage;
+    }
+    
+    if (vblock_csum_init(vblock_dev) < 0) {
+        goto cleanup_stats;
+    }
+    
+    if (vblock_compress_init(vblock_dev) < 0) {
+        goto cleanup_csum;
+    }
+    
+    // Replicas are written from a thread, reads may be served by them
+    if (vblock_mirror_init(vblock_dev) < 0) {
+        pr_err("Error in mirror setup\n");
+        goto cleanup_compress;
+    }
+    
+    // Contents persist in image_path if one is given
+    if (vblock_image_init(vblock_dev) < 0) {
         goto cleanup_mirror;
     }
     
+    // Allocate device number, minor 0 is the device and the others its snapshots
+    if (alloc_chrdev_region(&vblock_dev->dev_no, 0, VBLOCK_MAX_SNAPSHOTS + 1,
+                            DEVICE_NUMBER) < 0) {
+        pr_err("Error in device number creation\n");
+        goto cleanup_image;
+    }
+    
     pr_info("Major: %d Minor: %d\n", 
             MAJOR(vblock_dev->dev_no), MINOR(vblock_dev->dev_no));
     
@@ -292,7 +3708,7 @@ static int __init block_dev_init(void)
     cdev_init(&vblock_dev->cdev, &block_dev_f_ops);
     vblock_dev->cdev.owner = THIS_MODULE;
     
-    if (cdev_add(&vblock_dev->cdev, vblock_dev->dev_no, 1) < 0) {
+    if (cdev_add(&vblock_dev->cdev, vblock_dev->dev_no, VBLOCK_MAX_SNAPSHOTS + 1) < 0) {
         pr_err("Error in adding cdev\n");
         goto cleanup_chrdev;
     }
@@ -312,21 +3728,63 @@ static int __init block_dev_init(void)
         goto cleanup_class;
     }
     
+    // Register the block device
+    if (vblock_blk_init(vblock_dev) < 0) {
+        goto cleanup_device;
+    }
+    
+    if (backup_path && backup_interval_ms) {
+        queue_delayed_work(system_unbound_wq, &vblock_dev->backup_work,
+                           msecs_to_jiffies(backup_interval_ms));
+        pr_info("Backing up to %s every %u ms\n", backup_path, backup_interval_ms);
+    }
+    
+    // The scrubber is optional, the device works without it
+    vblock_dev->scrub_thread = kthread_run(vblock_scrub_thread, vblock_dev, "vblock_scrub");
+    if (IS_ERR(vblock_dev->scrub_thread)) {
+        pr_err("Failed to start the scrubber\n");
+        vblock_dev->scrub_thread = NULL;
+    }
+    
+    if (vblock_dev->ztfm) {
+        vblock_dev->zthread = kthread_run(vblock_zthread, vblock_dev, "vblock_compress");
+        if (IS_ERR(vblock_dev->zthread)) {
+            pr_err("Failed to start the compressor\n");
+            vblock_dev->zthread = NULL;
+        }
+    }
+    
     pr_info("Module Inserted successfully\n");
-    pr_info("Total size: %d bytes, %d regions of %d bytes each\n",
-            TOTAL_SIZE, TOTAL_REGIONS, REGION_SIZE);
+    pr_info("Total size: %llu bytes, %u regions of %u bytes each\n",
+            vblock_dev->size, vblock_dev->total_regions, vblock_dev->region_size);
     
     return 0;
 
+cleanup_device:
+    device_destroy(vblock_dev->class, vblock_dev->dev_no);
 cleanup_class:
     class_destroy(vblock_dev->class);
 cleanup_cdev:
     cdev_del(&vblock_dev->cdev);
 cleanup_chrdev:
-    unregister_chrdev_region(vblock_dev->dev_no, 1);
+    unregister_chrdev_region(vblock_dev->dev_no, VBLOCK_MAX_SNAPSHOTS + 1);
+cleanup_image:
+    vblock_image_exit(vblock_dev);
 cleanup_mirror:
-    if (vblock_dev->mirror_buffer)
-        kfree(vblock_dev->mirror_buffer);
+    vblock_mirror_exit(vblock_dev);
+cleanup_compress:
+    vblock_compress_exit(vblock_dev);
+cleanup_csum:
+    vblock_csum_exit(vblock_dev);
+cleanup_stats:
+    vblock_stats_exit(vblock_dev);
+cleanup_storage:
+    vblock_free_pages(&vblock_dev->pages);
+    percpu_free_rwsem(&vblock_dev->snap_sem);
+    kvfree(vblock_dev->cow_gen);
+    kvfree(vblock_dev->locked);
+    kvfree(vblock_dev->dirty);
+    kfree(vblock_dev->meta_locks);
     kfree(vblock_dev);
     
     return -1;
@@ -337,17 +3795,63 @@ cleanup_mirror:
 ***********************************************/
 static void __exit block_dev_exit(void)
 {
-    pr_info("Removing 4KB Block Storage Device\n");
+    struct vblock_snapshot *snap, *tmp;
+    unsigned long index;
+    void *copy;
+    
+    pr_info("Removing vblock storage device\n");
     
     if (vblock_dev) {
+        vblock_blk_exit(vblock_dev);
+        
+        // The scrubber reads the replicas, stop it before the mirror goes
+        if (vblock_dev->scrub_thread) {
+            kthread_stop(vblock_dev->scrub_thread);
+            vblock_dev->scrub_thread = NULL;
+        }
+        
+        if (vblock_dev->zthread) {
+            kthread_stop(vblock_dev->zthread);
+            vblock_dev->zthread = NULL;
+        }
+        
+        // No file is open any more, newest first so copies are never moved
+        list_for_each_entry_safe_reverse(snap, tmp, &vblock_dev->snapshots, list) {
+            xa_for_each(&snap->regions, index, copy)
+                kfree(copy);
+            xa_destroy(&snap->regions);
+            device_destroy(vblock_dev->class, vblock_dev->dev_no + snap->slot + 1);
+            list_del(&snap->list);
+            kfree(snap);
+        }
+        
         device_destroy(vblock_dev->class, vblock_dev->dev_no);
         class_destroy(vblock_dev->class);
         cdev_del(&vblock_dev->cdev);
-        unregister_chrdev_region(vblock_dev->dev_no, 1);
+        unregister_chrdev_region(vblock_dev->dev_no, VBLOCK_MAX_SNAPSHOTS + 1);
+        
+        // Nothing can write any more, flush the last changes
+        vblock_image_exit(vblock_dev);
+        vblock_mirror_exit(vblock_dev);
+        cancel_delayed_work_sync(&vblock_dev->backup_work);
+        if (backup_path) {
+            vblock_backup_to_file(backup_path);
+        }
+        kfree(vblock_dev->backup_file);
+        vblock_compress_exit(vblock_dev);
+        vblock_csum_exit(vblock_dev);
+        vblock_stats_exit(vblock_dev);
+        
+        vblock_free_pages(&vblock_dev->pages);
         
-        if (vblock_dev->mirror_buffer)
-            kfree(vblock_dev->mirror_buffer);
+        if (vblock_dev->inode)
+            iput(vblock_dev->inode);
         
+        percpu_free_rwsem(&vblock_dev->snap_sem);
+        kvfree(vblock_dev->cow_gen);
+        kvfree(vblock_dev->locked);
+        kvfree(vblock_dev->dirty);
+        kfree(vblock_dev->meta_locks);
         kfree(vblock_dev);
     }
     
@@ -359,7 +3863,46 @@ static void __exit block_dev_exit(void)
 ***********************************************/
 static int block_dev_open(struct inode* inode, struct file* file)
 {
-    file->private_data = vblock_dev;
+    unsigned int minor = iminor(inode) - MINOR(vblock_dev->dev_no);
+    struct vblock_file *vf;
+    int ret;
+    
+    vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+    if (!vf) {
+        return -ENOMEM;
+    }
+    
+    vf->dev = vblock_dev;
+    vf->mode = VBLOCK_MODE_ASCII;
+    file->private_data = vf;
+    
+    // Minors after the first are the snapshots, readable only
+    if (minor > 0) {
+        mutex_lock(&vblock_dev->snap_mutex);
+        vf->snap = vblock_dev->snaps[minor - 1];
+        if (vf->snap) {
+            kref_get(&vf->snap->ref);
+        }
+        mutex_unlock(&vblock_dev->snap_mutex);
+        
+        ret = 0;
+        if (!vf->snap) {
+            ret = -ENXIO;
+        } else if (file->f_mode & FMODE_WRITE) {
+            ret = -EROFS;
+        }
+        
+        if (ret) {
+            block_dev_release(inode, file);
+        }
+        return ret;
+    }
+    
+    // All files share one address space so locking a region can zap every mapping
+    if (!cmpxchg(&vblock_dev->inode, NULL, inode)) {
+        ihold(inode);
+    }
+    file->f_mapping = vblock_dev->inode->i_mapping;
     pr_debug("Block device opened\n");
     return 0;
 }
@@ -369,60 +3912,137 @@ static int block_dev_open(struct inode* inode, struct file* file)
 ***********************************************/
 static int block_dev_release(struct inode* inode, struct file* file)
 {
+    struct vblock_file *vf = file->private_data;
+    
+    if (vf->snap) {
+        kref_put(&vf->snap->ref, vblock_snapshot_release);
+    }
+    bitmap_free(vf->unlocked);
+    kfree(vf);
     pr_debug("Block device closed\n");
     return 0;
 }
 
+/***********************************************
+* Seek Function.
+***********************************************/
+static loff_t block_dev_llseek(struct file* file, loff_t offset, int whence)
+{
+    struct vblock_file *vf = file->private_data;
+    
+    return fixed_size_llseek(file, offset, whence, vf->dev->size);
+}
+
+/***********************************************
+* Mmap Function.
+***********************************************/
+static int block_dev_mmap(struct file* file, struct vm_area_struct* vma)
+{
+    struct vblock_file *vf = file->private_data;
+    u64 end = ((u64)vma->vm_pgoff + vma_pages(vma)) << PAGE_SHIFT;
+    
+    // Faults map live pages, snapshots are only readable with read()
+    if (vf->snap) {
+        return -ENODEV;
+    }
+    
+    if (end > round_up(vf->dev->size, PAGE_SIZE)) {
+        return -EINVAL;
+    }
+    
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &vblock_vm_ops;
+    return 0;
+}
+
 /***********************************************
 * Read Function.
 ***********************************************/
-static ssize_t block_dev_read(struct file* filep, char __user* buffer,
+static ssize_t __block_dev_read(struct file* filep, char __user* buffer,
      size_t count, loff_t* lofft)
 {
-    struct vblock_device *dev = filep->private_data;
-    int region_num, region_offset;
+    struct vblock_file *vf = filep->private_data;
+    struct vblock_device *dev = vf->dev;
+    unsigned int region_num, region_offset;
+    struct vblock_range range;
+    struct xarray *pages;
     size_t to_read, chunk;
     ssize_t ret = 0;
+    u64 pos;
+    int err = 0;
     
     // Validate offset
-    if (*lofft >= TOTAL_SIZE) {
+    if (*lofft < 0 || *lofft >= dev->size || count == 0) {
         return 0;
     }
     
+    // Don't read past device boundary
+    to_read = min_t(u64, count, dev->size - *lofft);
+
+retry:
+    // Keep the snapshot's copies in place for the whole read
+    if (vf->snap) {
+        percpu_down_read(&dev->snap_sem);
+        if (vf->snap->deleted) {
+            percpu_up_read(&dev->snap_sem);
+            err = -ENODEV;
+            goto out;
+        }
+    }
+    
     // Calculate region and offset
-    region_num = *lofft / REGION_SIZE;
-    region_offset = *lofft % REGION_SIZE;
+    region_num = (*lofft + ret) / dev->region_size;
+    region_offset = (*lofft + ret) % dev->region_size;
     
-    // Don't read past device boundary
-    to_read = min_t(size_t, count, TOTAL_SIZE - *lofft);
+    // Shared lock on the whole span, concurrent readers do not serialize
+    if (vblock_read_lock(dev, &range, *lofft + ret, to_read, true)) {
+        if (vf->snap) {
+            percpu_up_read(&dev->snap_sem);
+        }
+        err = -ERESTARTSYS;
+        goto out;
+    }
     
     while (to_read > 0) {
-        if (region_num >= TOTAL_REGIONS) {
-            break;
-        }
-        
-        chunk = min_t(size_t, REGION_SIZE - region_offset, to_read);
-        
-        // Acquire read semaphore
-        if (down_interruptible(&dev->regions[region_num].read_sem)) {
-            return -ERESTARTSYS;
-        }
+        chunk = min_t(size_t, dev->region_size - region_offset, to_read);
         
         // Copy to userspace
-        if (copy_to_user(buffer + ret, 
-                         dev->regions[region_num].data + region_offset, chunk)) {
-            up(&dev->regions[region_num].read_sem);
-            return -EFAULT;
+        pos = region_pos(dev, region_num) + region_offset;
+        if (vf->snap) {
+            err = vblock_snap_load_user(dev, vf->snap, pos, buffer + ret, chunk);
+        } else {
+            pages = vblock_read_pages(dev, region_num);
+            err = pages ? vblock_read_span_user(dev, pages, pos, buffer + ret, chunk) : -EIO;
         }
         
-        up(&dev->regions[region_num].read_sem);
+        if (err)
+            break;
         
+        vblock_stat_io(dev, region_num, false, chunk);
         ret += chunk;
         to_read -= chunk;
         region_offset = 0;
         region_num++;
     }
     
+    vblock_range_unlock(dev, &range);
+    
+    if (vf->snap) {
+        percpu_up_read(&dev->snap_sem);
+    }
+    
+    // The copy does not fault, the buffer is faulted in with nothing locked
+    if (err == -EFAULT && !fault_in_writeable(buffer + ret, chunk)) {
+        err = 0;
+        goto retry;
+    }
+
+out:
+    // Report an error only if nothing was read
+    if (ret == 0 && err) {
+        return err;
+    }
+    
     if (ret > 0) {
         *lofft += ret;
     }
@@ -430,19 +4050,112 @@ static ssize_t block_dev_read(struct file* filep, char __user* buffer,
     return ret;
 }
 
+static ssize_t block_dev_read(struct file* filep, char __user* buffer,
+     size_t count, loff_t* lofft)
+{
+    struct vblock_file *vf = filep->private_data;
+    u64 start = vblock_stat_start(vf->dev);
+    ssize_t ret;
+    
+    ret = __block_dev_read(filep, buffer, count, lofft);
+    vblock_stat_latency(vf->dev, VBLOCK_LAT_READ, start);
+    
+    return ret;
+}
+
 /***********************************************
 * Write Function.
 ***********************************************/
-static ssize_t block_dev_write(struct file* filep, const char __user* buffer,
+/*
+ * Binary mode write: the payload goes straight from the user buffer into
+ * the region pages at *lofft, with no parsing and no allocation.
+ */
+static ssize_t block_dev_write_binary(struct vblock_file *vf, const char __user* buffer,
+     size_t count, loff_t* lofft)
+{
+    struct vblock_device *dev = vf->dev;
+    struct vblock_range range;
+    unsigned int region_num, region_offset;
+    size_t to_write, chunk;
+    ssize_t ret = 0;
+    int err = 0;
+    
+    if (*lofft < 0 || *lofft >= dev->size) {
+        return count ? -ENOSPC : 0;
+    }
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    to_write = min_t(u64, count, dev->size - *lofft);
+
+retry:
+    region_num = (*lofft + ret) / dev->region_size;
+    region_offset = (*lofft + ret) % dev->region_size;
+    
+    // The whole span is locked once, so the write is atomic to other writes
+    // unless part of the buffer has to be faulted in
+    err = vblock_write_lock(dev, &range, *lofft + ret, to_write, true);
+    if (err) {
+        goto out;
+    }
+    
+    while (to_write > 0) {
+        chunk = min_t(size_t, dev->region_size - region_offset, to_write);
+        
+        // Locked regions need a VBLOCK_FD_UNLOCK on this file
+        if (!vblock_file_may_write(vf, region_num)) {
+            err = -EACCES;
+        } else {
+            err = vblock_write_span_user(dev, region_pos(dev, region_num) + region_offset,
+                                         buffer + ret, chunk);
+        }
+        
+        if (err)
+            break;
+        
+        vblock_stat_io(dev, region_num, true, chunk);
+        ret += chunk;
+        to_write -= chunk;
+        region_offset = 0;
+        region_num++;
+    }
+    
+    vblock_write_unlock(dev, &range);
+    
+    // The copy does not fault, the buffer is faulted in with nothing locked
+    if (err == -EFAULT && !fault_in_readable(buffer + ret, chunk)) {
+        err = 0;
+        goto retry;
+    }
+
+out:
+    // Report an error only if nothing was written
+    if (ret == 0 && err) {
+        return err;
+    }
+    
+    *lofft += ret;
+    return ret;
+}
+
+static ssize_t __block_dev_write(struct file* filep, const char __user* buffer,
      size_t count, loff_t* lofft)
 {
-    struct vblock_device *dev = filep->private_data;
+    struct vblock_file *vf = filep->private_data;
+    struct vblock_device *dev = vf->dev;
     char *kernel_buf, *data_ptr = NULL;
-    int region_num, region_offset;
+    unsigned int region_num, region_offset;
+    struct vblock_range range;
     int key = 0, key_status;
     size_t data_len, chunk;
     ssize_t ret = 0;
-    bool key_required = false;
+    int err = 0;
+    
+    if (vf->mode == VBLOCK_MODE_BINARY) {
+        return block_dev_write_binary(vf, buffer, count, lofft);
+    }
     
     // Allocate kernel buffer
     kernel_buf = kmalloc(count + 1, GFP_KERNEL);
@@ -479,78 +4192,61 @@ static ssize_t block_dev_write(struct file* filep, const char __user* buffer,
     data_len = strlen(data_ptr);
     
     // Validate offset
-    if (*lofft < 0 || *lofft >= TOTAL_SIZE) {
+    if (*lofft < 0 || *lofft >= dev->size) {
         kfree(kernel_buf);
         return -EINVAL;
     }
     
     // Calculate region and offset
-    region_num = *lofft / REGION_SIZE;
-    region_offset = *lofft % REGION_SIZE;
+    region_num = *lofft / dev->region_size;
+    region_offset = *lofft % dev->region_size;
+    data_len = min_t(u64, data_len, dev->size - *lofft);
     
-    // Get target region
-    if (region_num >= TOTAL_REGIONS) {
+    if (data_len == 0) {
         kfree(kernel_buf);
-        return -EINVAL;
-    }
-    
-    // Check if region is locked
-    if (dev->regions[region_num].locked) {
-        key_required = true;
-        if (key_status != 1) {
-            kfree(kernel_buf);
-            return -EACCES;
-        }
-        
-        // Check if key is valid
-        if (!is_valid_key(dev, key)) {
-            kfree(kernel_buf);
-            return -EACCES;
-        }
-        
-        // Check if key matches region's lock key
-        if (key != dev->regions[region_num].lock_key) {
-            kfree(kernel_buf);
-            return -EPERM;
-        }
+        return 0;
     }
     
-    // Acquire region mutex for write
-    mutex_lock(&dev->regions[region_num].region_mutex);
-    
-    // Acquire read semaphore
-    if (down_interruptible(&dev->regions[region_num].read_sem)) {
-        mutex_unlock(&dev->regions[region_num].region_mutex);
+    // Lock the whole span exclusively, writes overlapping it never interleave
+    err = vblock_write_lock(dev, &range, *lofft, data_len, true);
+    if (err) {
         kfree(kernel_buf);
-        return -ERESTARTSYS;
+        return err;
     }
     
-    // Write data in chunks
-    while (data_len > 0 && region_num < TOTAL_REGIONS) {
-        chunk = min_t(size_t, REGION_SIZE - region_offset, data_len);
-        
-        // Copy data to region
-        memcpy(dev->regions[region_num].data + region_offset, 
-               data_ptr + ret, chunk);
+    // Write data in chunks of one region each
+    while (data_len > 0) {
+        chunk = min_t(size_t, dev->region_size - region_offset, data_len);
         
-        // Mirror if enabled
-        if (dev->mirror_enable && dev->mirror_buffer) {
-            loff_t mirror_offset = (region_num * REGION_SIZE) + region_offset;
-            memcpy(dev->mirror_buffer + mirror_offset,
-                   data_ptr + ret, chunk);
+        // Lock state is checked under the span lock so it cannot change mid-write.
+        // A region this file unlocked takes no key.
+        err = vblock_file_may_write(vf, region_num) ? 0 :
+              check_region_key(dev, region_num, key_status, key);
+        if (!err) {
+            // Copy data to region
+            err = vblock_write_span(dev, region_pos(dev, region_num) + region_offset,
+                                    data_ptr + ret, chunk, GFP_KERNEL);
         }
         
+        if (err)
+            break;
+        
+        vblock_stat_io(dev, region_num, true, chunk);
         ret += chunk;
         data_len -= chunk;
         region_offset = 0;
         region_num++;
     }
     
-    up(&dev->regions[region_num-1].read_sem);
-    mutex_unlock(&dev->regions[region_num-1].region_mutex);
+    vblock_write_unlock(dev, &range);
     
     kfree(kernel_buf);
     
+    // Report an error only if nothing was written
+    if (ret == 0 && err) {
+        return err;
+    }
+    
     if (ret > 0) {
         *lofft += ret;
     }
@@ -558,17 +4254,40 @@ static ssize_t block_dev_write(struct file* filep, const char __user* buffer,
     return ret;
 }
 
+static ssize_t block_dev_write(struct file* filep, const char __user* buffer,
+     size_t count, loff_t* lofft)
+{
+    struct vblock_file *vf = filep->private_data;
+    u64 start = vblock_stat_start(vf->dev);
+    ssize_t ret;
+    
+    ret = __block_dev_write(filep, buffer, count, lofft);
+    vblock_stat_latency(vf->dev, VBLOCK_LAT_WRITE, start);
+    
+    return ret;
+}
+
 /***********************************************
 * IOCTL Function.
 ***********************************************/
-static long block_dev_ioctl(struct file* file, unsigned int cmd,
+static long __block_dev_ioctl(struct file* file, unsigned int cmd,
      unsigned long args)
 {
-    struct vblock_device *dev = file->private_data;
+    struct vblock_file *vf = file->private_data;
+    struct vblock_device *dev = vf->dev;
     int region_num;
     struct region_data reg_data;
+    struct region_key reg_key;
     struct device_info info;
-    int i;
+    struct vblock_extent ext;
+    struct vblock_range range;
+    struct xarray *pages;
+    int i, mode, ret;
+    
+    // Snapshots are read-only
+    if (vf->snap && cmd != VBLOCK_GET_INFO && cmd != VBLOCK_GET_INFO_V2) {
+        return -EROFS;
+    }
     
     switch(cmd)
     {
@@ -577,21 +4296,22 @@ static long block_dev_ioctl(struct file* file, unsigned int cmd,
                 return -EFAULT;
             }
             
-            if (region_num < 0 || region_num >= TOTAL_REGIONS) {
+            if (!region_valid(dev, region_num)) {
                 return -EINVAL;
             }
             
-            mutex_lock(&dev->regions[region_num].region_mutex);
+            region_lock(dev, &range, region_num, true, false);
             
-            if (!dev->regions[region_num].locked) {
-                dev->regions[region_num].locked = 1;
-                // Use a simple key generation (region number + 1000)
-                dev->regions[region_num].lock_key = region_num + 1000;
+            if (!region_locked(dev, region_num)) {
+                write_seqlock(&dev->lock_seq);
+                set_bit(region_num, dev->locked);
+                write_sequnlock(&dev->lock_seq);
+                vblock_zap_region(dev, region_num);
                 pr_debug("Region %d locked with key %d\n", 
-                        region_num, dev->regions[region_num].lock_key);
+                        region_num, region_lock_key(region_num));
             }
             
-            mutex_unlock(&dev->regions[region_num].region_mutex);
+            vblock_range_unlock(dev, &range);
             break;
             
         case VBLOCK_UNLOCK_REGION:
@@ -599,40 +4319,53 @@ static long block_dev_ioctl(struct file* file, unsigned int cmd,
                 return -EFAULT;
             }
             
-            if (region_num < 0 || region_num >= TOTAL_REGIONS) {
+            if (!region_valid(dev, region_num)) {
                 return -EINVAL;
             }
             
-            mutex_lock(&dev->regions[region_num].region_mutex);
+            region_lock(dev, &range, region_num, true, false);
             
-            if (dev->regions[region_num].locked) {
-                dev->regions[region_num].locked = 0;
-                dev->regions[region_num].lock_key = 0;
+            if (region_locked(dev, region_num)) {
+                write_seqlock(&dev->lock_seq);
+                clear_bit(region_num, dev->locked);
+                write_sequnlock(&dev->lock_seq);
                 pr_debug("Region %d unlocked\n", region_num);
             }
             
-            mutex_unlock(&dev->regions[region_num].region_mutex);
+            vblock_range_unlock(dev, &range);
             break;
             
         case VBLOCK_READ_REGION:
+            // struct region_data holds exactly REGION_DATA_SIZE bytes
+            if (dev->region_size != REGION_DATA_SIZE) {
+                return -EOPNOTSUPP;
+            }
+            
             if (copy_from_user(&reg_data, (struct region_data __user *)args,
                               sizeof(struct region_data))) {
                 return -EFAULT;
             }
             
-            if (reg_data.region_num < 0 || reg_data.region_num >= TOTAL_REGIONS) {
+            if (!region_valid(dev, reg_data.region_num)) {
                 return -EINVAL;
             }
             
-            // Acquire read semaphore
-            if (down_interruptible(&dev->regions[reg_data.region_num].read_sem)) {
+            if (region_lock(dev, &range, reg_data.region_num, false, true)) {
                 return -ERESTARTSYS;
             }
             
             // Copy region data
-            memcpy(reg_data.data, dev->regions[reg_data.region_num].data, REGION_SIZE);
+            pages = vblock_read_pages(dev, reg_data.region_num);
+            ret = pages ? vblock_read_span(dev, pages, region_pos(dev, reg_data.region_num),
+                                           reg_data.data, REGION_DATA_SIZE) : -EIO;
+            
+            vblock_range_unlock(dev, &range);
             
-            up(&dev->regions[reg_data.region_num].read_sem);
+            if (ret) {
+                return ret;
+            }
+            
+            vblock_stat_io(dev, reg_data.region_num, false, REGION_DATA_SIZE);
             
             if (copy_to_user((struct region_data __user *)args, &reg_data,
                             sizeof(struct region_data))) {
@@ -643,17 +4376,17 @@ static long block_dev_ioctl(struct file* file, unsigned int cmd,
         case VBLOCK_GET_INFO:
             memset(&info, 0, sizeof(info));
             
-            // Build lock bitmap
+            // Build lock bitmap, it only has room for the first 8 regions, V2 has all
             info.lock_bitmap = 0;
-            for (i = 0; i < TOTAL_REGIONS; i++) {
-                if (dev->regions[i].locked) {
+            for (i = 0; i < min_t(unsigned int, dev->total_regions, 8); i++) {
+                if (region_locked(dev, i)) {
                     info.lock_bitmap |= (1 << i);
                 }
             }
             
-            info.mirror_enabled = dev->mirror_enable;
-            info.total_regions = TOTAL_REGIONS;
-            info.region_size = REGION_SIZE;
+            info.mirror_enabled = dev->nr_replicas > 0;
+            info.total_regions = dev->total_regions;
+            info.region_size = dev->region_size;
             info.key_count = dev->key_count;
             memcpy(info.valid_keys, dev->user_keys, 
                    min(dev->key_count, MAX_KEYS) * sizeof(int));
@@ -669,36 +4402,120 @@ static long block_dev_ioctl(struct file* file, unsigned int cmd,
                 return -EFAULT;
             }
             
-            if (region_num < 0 || region_num >= TOTAL_REGIONS) {
+            if (!region_valid(dev, region_num)) {
                 return -EINVAL;
             }
             
-            mutex_lock(&dev->regions[region_num].region_mutex);
+            if (vblock_write_lock(dev, &range, region_pos(dev, region_num),
+                                  dev->region_size, true)) {
+                return -ERESTARTSYS;
+            }
             
             // Check if region is locked
-            if (dev->regions[region_num].locked) {
-                mutex_unlock(&dev->regions[region_num].region_mutex);
+            if (region_locked(dev, region_num)) {
+                vblock_write_unlock(dev, &range);
                 return -EACCES;
             }
             
-            if (down_interruptible(&dev->regions[region_num].read_sem)) {
-                mutex_unlock(&dev->regions[region_num].region_mutex);
+            // Erase region, its memory is freed once the whole page is erased
+            ret = vblock_discard(dev, region_pos(dev, region_num), dev->region_size, true,
+                                 GFP_KERNEL);
+            
+            vblock_write_unlock(dev, &range);
+            
+            if (ret) {
+                return ret;
+            }
+            
+            pr_debug("Region %d erased\n", region_num);
+            break;
+            
+        case VBLOCK_SET_MODE:
+            if (copy_from_user(&mode, (int __user *)args, sizeof(int))) {
+                return -EFAULT;
+            }
+            
+            if (mode != VBLOCK_MODE_ASCII && mode != VBLOCK_MODE_BINARY) {
+                return -EINVAL;
+            }
+            
+            vf->mode = mode;
+            break;
+            
+        case VBLOCK_FD_UNLOCK:
+            if (copy_from_user(&reg_key, (struct region_key __user *)args,
+                              sizeof(struct region_key))) {
+                return -EFAULT;
+            }
+            
+            return vblock_file_unlock(vf, &reg_key, 1);
+            
+        case VBLOCK_AUTH_REGIONS:
+            return vblock_auth_regions(vf, (struct vblock_auth __user *)args);
+            
+        case VBLOCK_GET_INFO_V2:
+            return vblock_get_info_v2(dev, (struct vblock_info_v2 __user *)args);
+            
+        case VBLOCK_SUBMIT_BATCH:
+            return vblock_submit_batch(vf, (struct vblock_batch __user *)args);
+            
+        case VBLOCK_SNAPSHOT:
+            ret = vblock_snapshot_create(dev);
+            if (ret < 0) {
+                return ret;
+            }
+            
+            if (copy_to_user((int __user *)args, &ret, sizeof(int))) {
+                return -EFAULT;
+            }
+            break;
+            
+        case VBLOCK_SNAPSHOT_DELETE:
+            if (copy_from_user(&i, (int __user *)args, sizeof(int))) {
+                return -EFAULT;
+            }
+            
+            return vblock_snapshot_delete(dev, i);
+            
+        case VBLOCK_DISCARD:
+        case VBLOCK_WRITE_ZEROES:
+            if (copy_from_user(&ext, (struct vblock_extent __user *)args, sizeof(ext))) {
+                return -EFAULT;
+            }
+            
+            if (ext.offset >= dev->size || ext.len > dev->size - ext.offset) {
+                return -EINVAL;
+            }
+            
+            if (ext.len == 0) {
+                break;
+            }
+            
+            if (vblock_write_lock(dev, &range, ext.offset, ext.len, true)) {
                 return -ERESTARTSYS;
             }
             
-            // Erase region
-            memset(dev->regions[region_num].data, 0, REGION_SIZE);
+            // Nothing is zeroed unless every region may be written through this file
+            ret = 0;
+            for (region_num = ext.offset / dev->region_size;
+                 region_num <= (ext.offset + ext.len - 1) / dev->region_size; region_num++) {
+                if (!vblock_file_may_write(vf, region_num)) {
+                    ret = -EACCES;
+                    break;
+                }
+            }
             
-            // Mirror erase if enabled
-            if (dev->mirror_enable && dev->mirror_buffer) {
-                memset(dev->mirror_buffer + (region_num * REGION_SIZE),
-                       0, REGION_SIZE);
+            // Only a discard gives the memory back
+            if (!ret) {
+                ret = vblock_discard(dev, ext.offset, ext.len, cmd == VBLOCK_DISCARD,
+                                     GFP_KERNEL);
             }
             
-            up(&dev->regions[region_num].read_sem);
-            mutex_unlock(&dev->regions[region_num].region_mutex);
+            vblock_write_unlock(dev, &range);
             
-            pr_debug("Region %d erased\n", region_num);
+            if (ret) {
+                return ret;
+            }
             break;
             
         default:
@@ -709,6 +4526,19 @@ static long block_dev_ioctl(struct file* file, unsigned int cmd,
     return 0;
 }
 
+static long block_dev_ioctl(struct file* file, unsigned int cmd,
+     unsigned long args)
+{
+    struct vblock_file *vf = file->private_data;
+    u64 start = vblock_stat_start(vf->dev);
+    long ret;
+    
+    ret = __block_dev_ioctl(file, cmd, args);
+    vblock_stat_latency(vf->dev, VBLOCK_LAT_IOCTL, start);
+    
+    return ret;
+}
+
 /**********************************************************************************
 * Module Init Exit registration.
 **********************************************************************************/
@@ -720,4 +4550,4 @@ module_exit(block_dev_exit);
 **********************************************************************************/
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Salman Al Fariz K");
-MODULE_DESCRIPTION("Device driver simulating 4KB sector storage");
\ No newline at end of file
+MODULE_DESCRIPTION("Device driver simulating sector storage");